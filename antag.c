@@ -0,0 +1,176 @@
+/*
+ * antag.c - Antagonist co-runners for the malloc driver
+ *
+ * Each antagonist is a thread that loops over its own buffer until it
+ * is stopped, pinned from its start to a cpu other than the driver's
+ * (the next cpus in order, usually sibling cores). The driver is pinned
+ * to its cpu meanwhile, so that it does not move onto theirs. If any of
+ * the pinning fails, nothing runs, shared cpus would skew the numbers:
+ *    bandwidth: sequential writes over twice the LLC, saturating DRAM
+ *    LLC:       random line writes over the LLC size, evicting the
+ *               driver's lines
+ *    TLB:       a write to one line of each of ANTAG_PAGES pages in a
+ *               random order, with huge pages turned off, missing the
+ *               shared second level TLB
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "antag.h"
+
+#define ANTAG_MAX      3          /* one thread per kind */
+#define ANTAG_LLC_DEF  (32<<20)   /* LLC size if sysconf does not know it */
+#define ANTAG_LLC_MAX  (64<<20)   /* cap on the buffers, keeps the footprint sane */
+#define ANTAG_PAGES    (1<<14)    /* pages walked by the TLB antagonist */
+#define LINE           64
+
+typedef struct {
+    pthread_t tid;
+    int kind;
+    char *buf;
+    size_t len;
+} antag_t;
+
+static antag_t antags[ANTAG_MAX];
+static int nantags;
+static volatile int antag_stop_flag;
+static cpu_set_t driver_cpus;     /* affinity of the driver before antag_start */
+
+/* xorshift, cheap enough not to be the bottleneck of the loops */
+static unsigned long next_rand(unsigned long *x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+static size_t llc_size(void)
+{
+    long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (llc <= 0)
+	llc = ANTAG_LLC_DEF;
+    return llc < ANTAG_LLC_MAX ? llc : ANTAG_LLC_MAX;
+}
+
+static void *antag_loop(void *arg)
+{
+    antag_t *a = arg;
+    unsigned long x = 88172645463325252UL;
+    size_t i, pagesize = getpagesize();
+    size_t lines = a->len / LINE, pages = a->len / pagesize;
+    int pass = 0;
+
+    while (!antag_stop_flag) {
+	switch (a->kind) {
+	case ANTAG_BW:
+	    memset(a->buf, pass++, a->len);
+	    break;
+	case ANTAG_LLC:
+	    for (i = 0; i < 4096; i++)
+		a->buf[(next_rand(&x) % lines) * LINE]++;
+	    break;
+	case ANTAG_TLB:
+	    for (i = 0; i < 4096; i++)
+		a->buf[(next_rand(&x) % pages) * pagesize + (i % 64) * LINE]++;
+	    break;
+	}
+    }
+    return NULL;
+}
+
+/*
+ * antag_parse - b, l and t select the bandwidth, LLC and TLB antagonists
+ */
+int antag_parse(const char *kinds)
+{
+    int bits = 0;
+
+    for (; *kinds; kinds++) {
+	switch (*kinds) {
+	case 'b': bits |= ANTAG_BW; break;
+	case 'l': bits |= ANTAG_LLC; break;
+	case 't': bits |= ANTAG_TLB; break;
+	default: return -1;
+	}
+    }
+    return bits;
+}
+
+/*
+ * antag_start - Start the antagonists of kinds
+ */
+int antag_start(int kinds)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int self = sched_getcpu(), k, err;
+    pthread_attr_t attr;
+    cpu_set_t set;
+
+    antag_stop_flag = 0;
+    nantags = 0;
+    if (ncpus < 2 || self < 0) { /* they would time-share the driver's cpu */
+	fprintf(stderr, "antag_start: no cpu apart from the driver's to pin to\n");
+	return -1;
+    }
+    sched_getaffinity(0, sizeof(driver_cpus), &driver_cpus);
+    CPU_ZERO(&set);
+    CPU_SET(self, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+	perror("antag_start: sched_setaffinity");
+	return -1;
+    }
+    for (k = ANTAG_BW; k <= ANTAG_TLB; k <<= 1) {
+	antag_t *a = &antags[nantags];
+	if (!(kinds & k))
+	    continue;
+	a->kind = k;
+	a->len = k == ANTAG_BW ? 2 * llc_size() :
+	    k == ANTAG_LLC ? llc_size() : (size_t)ANTAG_PAGES * getpagesize();
+	a->buf = mmap(NULL, a->len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (a->buf == MAP_FAILED) {
+	    perror("antag_start: mmap");
+	    continue;
+	}
+	if (k == ANTAG_TLB)
+	    madvise(a->buf, a->len, MADV_NOHUGEPAGE);
+	memset(a->buf, 0, a->len);
+	CPU_ZERO(&set);
+	CPU_SET((self + 1 + nantags % (ncpus - 1)) % ncpus, &set);
+	pthread_attr_init(&attr);
+	err = pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	if (err == 0)
+	    err = pthread_create(&a->tid, &attr, antag_loop, a);
+	pthread_attr_destroy(&attr);
+	if (err != 0) { /* pinning fails here too, e.g. a cpu outside our cpuset */
+	    fprintf(stderr, "antag_start: cannot start a pinned thread: %s\n", strerror(err));
+	    munmap(a->buf, a->len);
+	    antag_stop();
+	    return -1;
+	}
+	nantags++;
+    }
+    return nantags;
+}
+
+/*
+ * antag_stop - Stop the antagonists and release their buffers
+ */
+void antag_stop(void)
+{
+    int i;
+
+    antag_stop_flag = 1;
+    for (i = 0; i < nantags; i++) {
+	pthread_join(antags[i].tid, NULL);
+	munmap(antags[i].buf, antags[i].len);
+    }
+    nantags = 0;
+    sched_setaffinity(0, sizeof(driver_cpus), &driver_cpus);
+}
@@ -0,0 +1,18 @@
+/*
+ * Antagonist co-runners, threads that interfere with the memory system
+ * while the driver times an allocator
+ */
+#define ANTAG_BW  0x1  /* streams through a buffer: memory bandwidth */
+#define ANTAG_LLC 0x2  /* random lines of a buffer the size of the LLC */
+#define ANTAG_TLB 0x4  /* one line per page over many pages: TLB misses */
+
+/* Parse a -a argument such as "blt" into ANTAG_* bits, -1 if bogus */
+int antag_parse(const char *kinds);
+
+/* Start one thread per kind, pinned to cpus other than the caller's.
+   Return the number of threads started, -1 if there is no other cpu
+   or pinning fails */
+int antag_start(int kinds);
+
+/* Stop and join the threads */
+void antag_stop(void);
@@ -123,6 +123,30 @@ static void clear()
     sink = x;
 }
 
+/* 
+ * flush_fcyc_cache - Evict the caches by writing a bytes-sized buffer.
+ *     Unlike clear(), it stores, so untouched zero pages cannot fake it.
+ */
+static char *flush_buf = NULL;
+static int flush_bytes = 0;
+
+void flush_fcyc_cache(int bytes)
+{
+    char *cptr, *cend;
+    if (bytes > flush_bytes) {
+	free(flush_buf);
+	flush_buf = malloc(bytes);
+	if (!flush_buf) {
+	    fprintf(stderr, "Fatal error.  Malloc returned null when trying to flush cache\n");
+	    exit(1);
+	}
+	flush_bytes = bytes;
+    }
+    cend = flush_buf + bytes;
+    for (cptr = flush_buf; cptr < cend; cptr += cache_block)
+	*cptr = (char)sink++;
+}
+
 /*
  * fcyc - Use K-best scheme to estimate the running time of function f
  */
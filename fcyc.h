@@ -13,6 +13,12 @@ typedef void (*test_funct)(void *);
 /* Compute number of cycles used by test function f */
 double fcyc(test_funct f, void* argp);
 
+/* 
+ * flush_fcyc_cache - Write a buffer of the given size, one store per
+ *     cache block, to evict whatever the caches held before.
+ */
+void flush_fcyc_cache(int bytes);
+
 /*********************************************************
  * Set the various parameters used by measurement routines 
  *********************************************************/
@@ -8,6 +8,9 @@
 #include "ftimer.h"
 #include "config.h"
 
+/* bytes written to evict the caches before a cold run, above any LLC */
+#define COLD_CACHE_BYTES (64<<20)
+
 static double Mhz;  /* estimated CPU clock frequency */
 
 extern int verbose; /* -v option in mdriver.c */
@@ -55,3 +58,21 @@ double fsecs(fsecs_test_funct f, void *argp)
 }
 
 
+
+/*
+ * fsecs_cold - Return the running time of a single run of f (in seconds),
+ *     starting with the caches flushed. No K-best, no warmup.
+ */
+double fsecs_cold(fsecs_test_funct f, void *argp)
+{
+    flush_fcyc_cache(COLD_CACHE_BYTES);
+#if USE_FCYC
+    start_counter();
+    f(argp);
+    return get_counter()/(Mhz*1e6);
+#elif USE_ITIMER
+    return ftimer_itimer(f, argp, 1);
+#elif USE_GETTOD
+    return ftimer_gettod(f, argp, 1);
+#endif 
+}
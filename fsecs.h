@@ -2,3 +2,4 @@ typedef void (*fsecs_test_funct)(void *);
 
 void init_fsecs(void);
 double fsecs(fsecs_test_funct f, void *argp);
+double fsecs_cold(fsecs_test_funct f, void *argp);
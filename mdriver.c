@@ -9,6 +9,7 @@
  */
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <float.h>
 #include <setjmp.h>
 #include <signal.h>
@@ -18,26 +19,46 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "clock.h"
 #include "config.h"
 #include "driverlib.h"
+#include "antag.h"
 
 /**********************
  * Constants and macros
  **********************/
 
-/* OJ */
+/* OJ: read one trace from stdin, build with -DNO_OJ for the options */
+#ifndef NO_OJ
 #define OJ
+#endif
 
 /* Misc */
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
+/* Latency percentiles reported by -b */
+#define NPCTS 5
+static const double pcts[NPCTS] = {50, 90, 99, 99.9, 100};
+
+/* Weights of the abstract cost score of a -DMM_COST build of mm.c */
+#define COST_WORD   8    /* payload bytes copied or zeroed per unit */
+#define COST_EXTEND 100  /* units per heap extension, a system call in a real heap */
+#define COST_SCORE(c) ((double)(c).nodes + (c).reads + (c).writes + \
+		(double)(c).bytes / COST_WORD + (double)(c).extends * COST_EXTEND)
+
+/* Bits of a /proc/self/pagemap entry, used by -F */
+#define PM_PRESENT   63
+#define PM_EXCLUSIVE 56
+
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
@@ -100,13 +121,28 @@ typedef struct {
 	/* run-time stats defined for both libc and student */
 	int valid;       /* was the trace processed correctly by the allocator? */
 	double secs;     /* number of secs needed to run the trace */
+	double cold_secs;/* secs of a single first run: fresh heap, flushed caches */
 
 	/* defined only for the student malloc package */
 	double util;     /* space utilization for this trace (always 0 for libc) */
+	double lat[2][NPCTS]; /* per-op cycles at pcts, worker off and on (-b) */
+	long fork[4];    /* heap pages at fork, heap and metadata pages copied, minor faults in the child (-F) */
+	double antag_secs;          /* secs with the antagonists running (-a) */
+	double antag_lat[2][NPCTS]; /* per-op cycles at pcts, quiet and with the antagonists (-a) */
+	mm_cost_t cost;  /* abstract work of one replay, if mm.c counts it */
 
 	/* Note: secs and util are only defined if valid is true */
 } stats_t;
 
+/* One trace of an interleaved replay (-m, -w), with its own block ids */
+typedef struct {
+	trace_t *trace;
+	int weight;        /* share of the requests picked under -w */
+	int next;          /* next request to issue */
+	double solo_util;  /* space utilization of the trace replayed alone */
+	double lat[NPCTS]; /* per-op cycles at pcts, interleaved */
+} source_t;
+
 
 /********************
  * For debugging.  If debug-mode is on, then we have each block start
@@ -135,6 +171,23 @@ int onetime_flag = 0;
 /* by default, no timeouts */
 static int set_timeout = 0;
 
+/* measure per-op latency with the background worker off and on (-b) */
+static int latency_flag = 0;
+
+/* count the heap and metadata pages a forked child copies on write (-F) */
+static int fork_flag = 0;
+
+/* traces to replay interleaved in one heap (-m, -w) */
+static char *mix_list = NULL;
+static int mix_weighted = 0;
+
+/* antagonists to run next to the timed runs (-a), see antag.h */
+static char *antag_arg = NULL;
+static int antag_kinds = 0;
+
+/* set when mm.c was built with -DMM_COST and counts its work */
+static int cost_flag = 0;
+
 
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
@@ -172,15 +225,25 @@ static void free_trace(trace_t *trace);
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace);
 static void eval_libc_speed(void *ptr);
+static void eval_libc_latency(trace_t *trace, double *lat);
 
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_latency(trace_t *trace, int worker, double *lat);
+static void eval_mm_fork(trace_t *trace, long *fork_stats);
+static double eval_mm_mix(source_t *sources, int n);
+static void eval_mm_cost(trace_t *trace, mm_cost_t *cost);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printlatency(int n, stats_t *stats);
+static void printfork(int n, stats_t *stats);
+static void printmix(source_t *sources, int n, double util);
+static void printantag(int n, stats_t *stats);
+static void printcost(int n, stats_t *stats);
 static void usage(void);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
 	__attribute__((format(printf, 3,4)));
@@ -196,6 +259,51 @@ static void app_error(const char *fmt, ...)
 		longjmp(timeout_jmpbuf, 1);
 	}
 
+/*
+ * run_mix - Read the traces of a -m/-w list, "file[:weight],...",
+ *    measure each alone, then replay them interleaved in one heap
+ */
+static void run_mix(const char *list, const char *tracedir)
+{
+	source_t *sources = NULL;
+	stats_t stats;
+	char *copy, *name, *colon;
+	double util;
+	int i, n = 0;
+
+	if ((copy = strdup(list)) == NULL)
+		unix_error("strdup failed in run_mix");
+	for (name = strtok(copy, ","); name != NULL; name = strtok(NULL, ",")) {
+		if ((sources = realloc(sources, (n + 1) * sizeof(source_t))) == NULL)
+			unix_error("realloc failed in run_mix");
+		memset(&sources[n], 0, sizeof(source_t));
+		sources[n].weight = 1;
+		if ((colon = strchr(name, ':')) != NULL) {
+			*colon = '\0';
+			if ((sources[n].weight = atoi(colon + 1)) <= 0)
+				app_error("run_mix: bad weight for %s", name);
+		}
+		sources[n].trace = read_trace(&stats, tracedir, name);
+		n++;
+	}
+	if (n == 0)
+		app_error("run_mix: no traces in \"%s\"", list);
+
+	for (i = 0; i < n; i++)
+		sources[i].solo_util = eval_mm_util(sources[i].trace, i);
+	util = eval_mm_mix(sources, n);
+
+	printf("\nInterleaved replay of %d traces in one heap, %s:\n", n,
+			mix_weighted ? "weighted random" : "round robin");
+	printmix(sources, n, util);
+	printf("\n");
+
+	for (i = 0; i < n; i++)
+		free_trace(sources[i].trace);
+	free(sources);
+	free(copy);
+}
+
 /* Run the tests; return the number of tests run (may be less than
    num_tracefiles, if there's a timeout) */
 static void run_tests(int num_tracefiles, char trace_from_stdin,
@@ -237,7 +345,25 @@ static void run_tests(int num_tracefiles, char trace_from_stdin,
 			speed_params->ranges = ranges;
 			if (verbose > 1)
 				printf("and performance.\n");
+			mem_remap();
+			mm_stats[i].cold_secs = fsecs_cold(eval_mm_speed, speed_params);
 			mm_stats[i].secs = fsecs(eval_mm_speed, speed_params);
+			if (latency_flag) {
+				eval_mm_latency(trace, 0, mm_stats[i].lat[0]);
+				eval_mm_latency(trace, 1, mm_stats[i].lat[1]);
+			}
+			if (fork_flag)
+				eval_mm_fork(trace, mm_stats[i].fork);
+			if (cost_flag)
+				eval_mm_cost(trace, &mm_stats[i].cost);
+			if (antag_kinds) {
+				eval_mm_latency(trace, 0, mm_stats[i].antag_lat[0]);
+				if (antag_start(antag_kinds) < 0)
+					app_error("antag_start failed\n");
+				mm_stats[i].antag_secs = fsecs(eval_mm_speed, speed_params);
+				eval_mm_latency(trace, 0, mm_stats[i].antag_lat[1]);
+				antag_stop();
+			}
 		}
 		free_trace(trace);
 	}
@@ -278,7 +404,7 @@ int main(int argc, char **argv)
 		num_tracefiles = 1;
 		trace_from_stdin = 1;
 #else
-	while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlDj")) != EOF) {
+	while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlDjbFm:w:a:")) != EOF) {
 		switch (c) {
 
 			case 'A': /* Hidden Autolab driver argument */
@@ -336,6 +462,35 @@ int main(int argc, char **argv)
 				set_timeout = atoi(optarg);
 				break;
 
+			case 'b': /* Report latency with the background worker off and on */
+				latency_flag = 1;
+				break;
+
+			case 'F': /* Count the pages a forked child copies */
+				fork_flag = 1;
+				break;
+
+			case 'm': /* Replay traces interleaved, round robin */
+				mix_list = optarg;
+				mix_weighted = 0;
+				break;
+
+			case 'w': /* Replay traces interleaved, weighted random */
+				mix_list = optarg;
+				mix_weighted = 1;
+				break;
+
+			case 'a': /* Time again next to antagonist threads */
+				antag_arg = optarg;
+				if ((antag_kinds = antag_parse(optarg)) <= 0) {
+					usage();
+					exit(1);
+				}
+				if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+					app_error("-a needs a second cpu: on the driver's own cpu the "
+							"antagonists measure time slicing, not interference\n");
+				break;
+
 			case 'j': /* For OJ */
 				num_tracefiles = 1;
 				trace_from_stdin = 1;
@@ -355,6 +510,9 @@ int main(int argc, char **argv)
 	if (trace_from_stdin) {
 		printf("Using stdin as tracefile\n");
 	}
+	else if (tracefiles == NULL && mix_list != NULL) {
+		printf("Replaying only the interleaved tracefiles in %s\n", tracedir);
+	}
 	else if (tracefiles == NULL) {
 		tracefiles = default_tracefiles;
 		num_tracefiles = sizeof(default_tracefiles) / sizeof(char *) - 1;
@@ -374,6 +532,13 @@ int main(int argc, char **argv)
 		signal(SIGALRM, timeout_handler);
 	}
 
+	/* -m or -w without -f: there are no single traces to run */
+	if (tracefiles == NULL && !trace_from_stdin) {
+		mem_init();
+		run_mix(mix_list, tracedir);
+		exit(0);
+	}
+
 	/*
 	 * Optionally run and evaluate the libc malloc package
 	 */
@@ -400,7 +565,16 @@ int main(int argc, char **argv)
 				speed_params.trace = trace;
 				if (verbose > 1)
 					printf("and performance.\n");
+				libc_stats[i].cold_secs = fsecs_cold(eval_libc_speed, &speed_params);
 				libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+				if (antag_kinds) {
+					eval_libc_latency(trace, libc_stats[i].antag_lat[0]);
+					if (antag_start(antag_kinds) < 0)
+						app_error("antag_start failed\n");
+					libc_stats[i].antag_secs = fsecs(eval_libc_speed, &speed_params);
+					eval_libc_latency(trace, libc_stats[i].antag_lat[1]);
+					antag_stop();
+				}
 			}
 			free_trace(trace);
 		}
@@ -409,6 +583,10 @@ int main(int argc, char **argv)
 		if (verbose) {
 			printf("\nResults for libc malloc:\n");
 			printresults(num_tracefiles, libc_stats);
+			if (antag_kinds) {
+				printf("\nSensitivity of libc malloc to antagonists %s:\n", antag_arg);
+				printantag(num_tracefiles, libc_stats);
+			}
 		}
 	}
 
@@ -425,6 +603,7 @@ int main(int argc, char **argv)
 
 	/* Initialize the simulated memory system in memlib.c */
 	mem_init();
+	cost_flag = mm_cost_get(NULL) == 0;
 
 	run_tests(num_tracefiles, trace_from_stdin, tracedir, tracefiles,
 			mm_stats, ranges, &speed_params);
@@ -443,9 +622,34 @@ int main(int argc, char **argv)
 			printf("\nResults for mm malloc:\n");
 			printresults(num_tracefiles, mm_stats);
 			printf("\n");
+			if (latency_flag) {
+				printf("Foreground latency in cycles, background worker off / on:\n");
+				printlatency(num_tracefiles, mm_stats);
+				printf("\n");
+			}
+			if (fork_flag) {
+				printf("Heap and metadata pages a forked child copies replaying the second half:\n");
+				printfork(num_tracefiles, mm_stats);
+				printf("\n");
+			}
+			if (antag_kinds) {
+				printf("Sensitivity to antagonists %s:\n", antag_arg);
+				printantag(num_tracefiles, mm_stats);
+				printf("\n");
+			}
+			if (cost_flag) {
+				printf("Abstract work per op, counted by mm.c (score = nodes + reads + writes"
+						" + bytes/%d + %d*ext):\n", COST_WORD, COST_EXTEND);
+				printcost(num_tracefiles, mm_stats);
+				printf("\n");
+			}
 		}
 	}
 
+	/* Optionally replay several traces interleaved in one heap */
+	if (mix_list != NULL)
+		run_mix(mix_list, tracedir);
+
 	/*
 	 * Accumulate the aggregate statistics for the student's mm package
 	 */
@@ -1196,6 +1400,305 @@ static void eval_mm_speed(void *ptr)
 		}
 }
 
+/*
+ * cmp_double - qsort comparator for eval_mm_latency
+ */
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * percentiles - Sort the n cycle counts and store the ones at pcts in lat
+ */
+static void percentiles(double *cycles, int n, double *lat)
+{
+	int j;
+
+	if (n == 0)
+		return;
+	qsort(cycles, n, sizeof(double), cmp_double);
+	for (j = 0; j < NPCTS; j++)
+		lat[j] = cycles[(int)(pcts[j] / 100.0 * (n - 1))];
+}
+
+/*
+ * eval_mm_latency - Run the trace once, timing every request on its own,
+ *    and store the cycle counts at the pcts percentiles in lat. With
+ *    worker set, the mm background worker runs for the whole trace.
+ */
+static void eval_mm_latency(trace_t *trace, int worker, double *lat)
+{
+	int i, index, size, newsize;
+	char *p, *newp, *oldp, *block;
+	double *cycles;
+
+	if ((cycles = (double *)malloc(trace->num_ops * sizeof(double))) == NULL)
+		unix_error("malloc failed in eval_mm_latency");
+	reinit_trace(trace);
+
+	/* Reset the heap and initialize the mm package */
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in eval_mm_latency");
+	if (worker && mm_worker_start() < 0)
+		app_error("mm_worker_start failed in eval_mm_latency");
+
+	for (i = 0;  i < trace->num_ops;  i++) {
+		start_counter();
+		switch (trace->ops[i].type) {
+
+			case ALLOC: /* mm_malloc */
+				index = trace->ops[i].index;
+				size = trace->ops[i].size;
+				if ((p = mm_malloc(size)) == NULL)
+					app_error("mm_malloc error in eval_mm_latency");
+				trace->blocks[index] = p;
+				break;
+
+			case REALLOC: /* mm_realloc */
+				index = trace->ops[i].index;
+				newsize = trace->ops[i].size;
+				oldp = trace->blocks[index];
+				if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0)
+					app_error("mm_realloc error in eval_mm_latency");
+				trace->blocks[index] = newp;
+				break;
+
+			case FREE: /* mm_free */
+				index = trace->ops[i].index;
+				block = (index < 0) ? 0 : trace->blocks[index];
+				mm_free(block);
+				break;
+
+			default:
+				app_error("Nonexistent request type in eval_mm_latency");
+		}
+		cycles[i] = get_counter();
+	}
+	if (worker)
+		mm_worker_stop();
+
+	percentiles(cycles, trace->num_ops, lat);
+	free(cycles);
+}
+
+/*
+ * replay_op - Run request i of the trace and return the change in
+ *    live payload bytes. With touch set, write the new payload, as an
+ *    application filling its blocks would.
+ */
+static long replay_op(trace_t *trace, int i, int touch)
+{
+	int index = trace->ops[i].index;
+	size_t size = trace->ops[i].size;
+	size_t oldsize;
+	char *p, *newp;
+
+	switch (trace->ops[i].type) {
+
+		case ALLOC: /* mm_malloc */
+			if ((p = mm_malloc(size)) == NULL)
+				app_error("mm_malloc error in replay_op");
+			if (touch)
+				memset(p, 0, size);
+			trace->blocks[index] = p;
+			trace->block_sizes[index] = size;
+			return size;
+
+		case REALLOC: /* mm_realloc */
+			oldsize = trace->block_sizes[index];
+			if ((newp = mm_realloc(trace->blocks[index], size)) == NULL && size != 0)
+				app_error("mm_realloc error in replay_op");
+			trace->blocks[index] = newp;
+			trace->block_sizes[index] = size;
+			return (long)size - (long)oldsize;
+
+		case FREE: /* mm_free */
+			if (index < 0) {
+				mm_free(NULL);
+				return 0;
+			}
+			mm_free(trace->blocks[index]);
+			return -(long)trace->block_sizes[index];
+
+		default:
+			app_error("Nonexistent request type in replay_op");
+	}
+}
+
+/*
+ * replay_mm - Run requests lo..hi-1 of the trace
+ */
+static void replay_mm(trace_t *trace, int lo, int hi, int touch)
+{
+	int i;
+
+	for (i = lo;  i < hi;  i++)
+		replay_op(trace, i, touch);
+}
+
+/*
+ * count_pages - Count the pages between lo and hi whose pagemap entry
+ *    has the given bit set, -1 if the pagemap cannot be read
+ */
+static long count_pages(char *lo, char *hi, int bit)
+{
+	long n = 0, pagesize = sysconf(_SC_PAGESIZE);
+	unsigned long long entry;
+	unsigned long page;
+	int fd;
+
+	if ((fd = open("/proc/self/pagemap", O_RDONLY)) < 0)
+		return -1;
+	for (page = (unsigned long)lo / pagesize; page <= (unsigned long)hi / pagesize; page++) {
+		if (pread(fd, &entry, sizeof(entry), page * sizeof(entry)) != sizeof(entry)) {
+			n = -1;
+			break;
+		}
+		n += (entry >> bit) & 1;
+	}
+	close(fd);
+	return n;
+}
+
+/*
+ * eval_mm_fork - Warm the heap with the first half of the trace, then
+ *    fork a child that replays the second half without writing any
+ *    payload, the pre-fork server pattern. Every heap page the child
+ *    holds exclusively afterwards was copied on write by the allocator,
+ *    and so was every page of its out of band metadata, if it has any.
+ *    Stores the heap pages present at the fork, the heap and metadata
+ *    pages copied (-1 without metadata pages) and the child's minor
+ *    faults in fork_stats.
+ */
+static void eval_mm_fork(trace_t *trace, long *fork_stats)
+{
+	struct rusage r0, r1;
+	int fds[2], status;
+	char *lo, *hi;
+	void *meta_lo, *meta_hi;
+	pid_t pid;
+
+	reinit_trace(trace);
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in eval_mm_fork");
+	replay_mm(trace, 0, trace->num_ops / 2, 1);
+	lo = mem_heap_lo();
+	hi = mem_heap_hi();
+	fork_stats[0] = count_pages(lo, hi, PM_PRESENT);
+
+	if (pipe(fds) < 0)
+		unix_error("pipe failed in eval_mm_fork");
+	if ((pid = fork()) < 0)
+		unix_error("fork failed in eval_mm_fork");
+	if (pid == 0) {
+		long child[3];
+		getrusage(RUSAGE_SELF, &r0);
+		replay_mm(trace, trace->num_ops / 2, trace->num_ops, 0);
+		getrusage(RUSAGE_SELF, &r1);
+		child[0] = count_pages(lo, hi, PM_EXCLUSIVE);
+		child[1] = -1;
+		if (mm_meta_range(&meta_lo, &meta_hi) == 0)
+			child[1] = meta_hi > meta_lo?
+				count_pages(meta_lo, (char *)meta_hi - 1, PM_EXCLUSIVE) : 0;
+		child[2] = r1.ru_minflt - r0.ru_minflt;
+		if (write(fds[1], child, sizeof(child)) != sizeof(child))
+			_exit(1);
+		_exit(0);
+	}
+	close(fds[1]);
+	if (read(fds[0], &fork_stats[1], 3 * sizeof(long)) != 3 * sizeof(long))
+		fork_stats[1] = fork_stats[2] = fork_stats[3] = -1;
+	close(fds[0]);
+	waitpid(pid, &status, 0);
+}
+
+/*
+ * eval_mm_mix - Replay the sources interleaved into one heap, each with
+ *    its own block ids. The next request comes from the next unfinished
+ *    source in turn, or with -w from one picked at random in proportion
+ *    to its weight, from a fixed seed. Stores each source's latency
+ *    percentiles and returns the combined space utilization.
+ */
+static double eval_mm_mix(source_t *sources, int n)
+{
+	double **cycles;
+	long live = 0, peak = 0;
+	unsigned int seed = 1;
+	int i, k = n - 1, left = n;
+	trace_t *trace;
+
+	if ((cycles = (double **)malloc(n * sizeof(double *))) == NULL)
+		unix_error("malloc failed in eval_mm_mix");
+	for (i = 0; i < n; i++) {
+		if ((cycles[i] = (double *)malloc(sources[i].trace->num_ops * sizeof(double))) == NULL)
+			unix_error("malloc failed in eval_mm_mix");
+		reinit_trace(sources[i].trace);
+		sources[i].next = 0;
+		if (sources[i].trace->num_ops == 0)
+			left--;
+	}
+
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in eval_mm_mix");
+
+	while (left > 0) {
+		if (mix_weighted) {
+			int total = 0, pick;
+			for (i = 0; i < n; i++)
+				if (sources[i].next < sources[i].trace->num_ops)
+					total += sources[i].weight;
+			pick = rand_r(&seed) % total;
+			for (k = 0; ; k++) {
+				if (sources[k].next == sources[k].trace->num_ops)
+					continue;
+				if ((pick -= sources[k].weight) < 0)
+					break;
+			}
+		} else {
+			do {
+				k = (k + 1) % n;
+			} while (sources[k].next == sources[k].trace->num_ops);
+		}
+
+		trace = sources[k].trace;
+		i = sources[k].next++;
+		start_counter();
+		live += replay_op(trace, i, 0);
+		cycles[k][i] = get_counter();
+		peak = live > peak ? live : peak;
+		if (sources[k].next == trace->num_ops)
+			left--;
+	}
+
+	for (i = 0; i < n; i++) {
+		percentiles(cycles[i], sources[i].trace->num_ops, sources[i].lat);
+		free(cycles[i]);
+	}
+	free(cycles);
+	return (double)peak / (double)mem_heapsize();
+}
+
+/*
+ * eval_mm_cost - Replay the trace once on a fresh heap and store the
+ *    work mm.c counted. The counts depend only on the trace and mm.c,
+ *    not on the machine or on timing.
+ */
+static void eval_mm_cost(trace_t *trace, mm_cost_t *cost)
+{
+	reinit_trace(trace);
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in eval_mm_cost");
+	mm_cost_reset();
+	replay_mm(trace, 0, trace->num_ops, 0);
+	mm_cost_get(cost);
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1293,6 +1796,48 @@ static void eval_libc_speed(void *ptr)
 	}
 }
 
+/*
+ * eval_libc_latency - Run the trace once with libc malloc, timing every
+ *    request on its own, and store the cycle counts at pcts in lat
+ */
+static void eval_libc_latency(trace_t *trace, double *lat)
+{
+	int i, index;
+	char *p, *newp;
+	double *cycles;
+
+	if ((cycles = (double *)malloc(trace->num_ops * sizeof(double))) == NULL)
+		unix_error("malloc failed in eval_libc_latency");
+	reinit_trace(trace);
+
+	for (i = 0;  i < trace->num_ops;  i++) {
+		index = trace->ops[i].index;
+		start_counter();
+		switch (trace->ops[i].type) {
+			case ALLOC: /* malloc */
+				if ((p = malloc(trace->ops[i].size)) == NULL)
+					unix_error("malloc failed in eval_libc_latency");
+				trace->blocks[index] = p;
+				break;
+
+			case REALLOC: /* realloc */
+				newp = realloc(trace->blocks[index], trace->ops[i].size);
+				if (newp == NULL && trace->ops[i].size != 0)
+					unix_error("realloc failed in eval_libc_latency");
+				trace->blocks[index] = newp;
+				break;
+
+			case FREE: /* free */
+				free(index >= 0 ? trace->blocks[index] : 0);
+				break;
+		}
+		cycles[i] = get_counter();
+	}
+
+	percentiles(cycles, trace->num_ops, lat);
+	free(cycles);
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
@@ -1306,36 +1851,40 @@ static void printresults(int n, stats_t *stats)
 	int i;
 	/* weighted sums all */
 	double sumsecs = 0;
+	double sumcold = 0;
 	double sumops  = 0;
 	double sumutil = 0;
 	int sumweight = 0;
 
 	/* Print the individual results for each trace */
-	printf("  %6s%6s %5s%8s%12s  %s\n",
-			"valid", "util", "ops", "secs", "Kops", "trace");
+	printf("  %6s%6s %5s%8s%12s%9s  %s\n",
+			"valid", "util", "ops", "secs", "Kops", "cold", "trace");
 	for (i=0; i < n; i++) {
 		if (stats[i].valid) {
-			printf("%2s%4s %5.0f%%%8.0f%10.6f%9.0f %s\n",
+			printf("%2s%4s %5.0f%%%8.0f%10.6f%9.0f%9.0f %s\n",
 					stats[i].weight != 0 ? "*" : "",
 					"yes",
 					stats[i].util*100.0,
 					stats[i].ops,
 					stats[i].secs,
 					(stats[i].ops/1e3)/stats[i].secs,
+					(stats[i].ops/1e3)/stats[i].cold_secs,
 					stats[i].filename);
 			sumweight += stats[i].weight;
 			sumsecs += stats[i].secs * stats[i].weight;
+			sumcold += stats[i].cold_secs * stats[i].weight;
 			sumops += stats[i].ops * stats[i].weight;
 			sumutil += stats[i].util * stats[i].weight;
 		}
 		else {
-			printf("%2s%4s %6s%8s%9s%9s %s\n",
+			printf("%2s%4s %6s%8s%9s%9s%9s %s\n",
 					stats[i].weight != 0 ? "*" : "",
 					"no",
 					"-",
 					"-",
 					"-",
 					"-",
+					"-",
 					stats[i].filename);
 		}
 	}
@@ -1344,15 +1893,17 @@ static void printresults(int n, stats_t *stats)
 	if (errors == 0) {
 		if(sumweight == 0) sumweight = 1;
 
-		printf("%2d     %5.0f%%%8.0f%10.6f%9.0f\n",
+		printf("%2d     %5.0f%%%8.0f%10.6f%9.0f%9.0f\n",
 				sumweight,
 				(sumutil/(double)sumweight)*100.0,
 				sumops,
 				sumsecs,
-				(sumsecs==0.0) ? 0 : (sumops/1e3)/sumsecs);
+				(sumsecs==0.0) ? 0 : (sumops/1e3)/sumsecs,
+				(sumcold==0.0) ? 0 : (sumops/1e3)/sumcold);
 	}
 	else {
-		printf("       %8s%10s%6s\n",
+		printf("       %8s%10s%6s%9s\n",
+				"-",
 				"-",
 				"-",
 				"-");
@@ -1360,6 +1911,125 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * printlatency - prints the -b latency percentiles of each trace
+ */
+static void printlatency(int n, stats_t *stats)
+{
+	int i, j;
+
+	printf("  %-6s", "bg");
+	for (j = 0; j < NPCTS; j++)
+		printf("%7s%-4g", "p", pcts[j]);
+	printf(" %s\n", "trace");
+	for (i = 0; i < n; i++) {
+		if (!stats[i].valid)
+			continue;
+		for (j = 0; j < 2; j++) {
+			int k;
+			printf("  %-6s", j ? "on" : "off");
+			for (k = 0; k < NPCTS; k++)
+				printf("%11.0f", stats[i].lat[j][k]);
+			printf(" %s\n", stats[i].filename);
+		}
+	}
+}
+
+/*
+ * printfork - prints the -F copy-on-write counts of each trace
+ */
+static void printfork(int n, stats_t *stats)
+{
+	int i;
+
+	printf("  %8s%8s%8s%8s %s\n", "pages", "copied", "meta", "faults", "trace");
+	for (i = 0; i < n; i++) {
+		if (!stats[i].valid)
+			continue;
+		printf("  %8ld%8ld", stats[i].fork[0], stats[i].fork[1]);
+		if (stats[i].fork[2] < 0)
+			printf("%8s", "-");
+		else
+			printf("%8ld", stats[i].fork[2]);
+		printf("%8ld %s\n", stats[i].fork[3], stats[i].filename);
+	}
+}
+
+/*
+ * printmix - prints the -m/-w latency percentiles of each source and
+ *    the utilization of the shared heap
+ */
+static void printmix(source_t *sources, int n, double util)
+{
+	int i, j;
+
+	printf("  %6s%6s", "weight", "solo");
+	for (j = 0; j < NPCTS; j++)
+		printf("%7s%-4g", "p", pcts[j]);
+	printf(" %s\n", "trace");
+	for (i = 0; i < n; i++) {
+		printf("  %6d%5.0f%%", sources[i].weight, sources[i].solo_util * 100.0);
+		for (j = 0; j < NPCTS; j++)
+			printf("%11.0f", sources[i].lat[j]);
+		printf(" %s\n", sources[i].trace->filename);
+	}
+	printf("Combined utilization %.0f%% (peak live bytes of all traces / heap size)\n",
+			util * 100.0);
+}
+
+/*
+ * printantag - prints the -a throughput and p50/p99 latency of each
+ *    trace, quiet and next to the antagonists
+ */
+static void printantag(int n, stats_t *stats)
+{
+	int i;
+	double kops, akops;
+
+	printf("  %8s%8s%7s%9s%9s%9s%9s %s\n", "Kops", "antag", "loss",
+			"p50", "antag", "p99", "antag", "trace");
+	for (i = 0; i < n; i++) {
+		if (!stats[i].valid || stats[i].secs == 0 || stats[i].antag_secs == 0)
+			continue;
+		kops = stats[i].ops / 1e3 / stats[i].secs;
+		akops = stats[i].ops / 1e3 / stats[i].antag_secs;
+		/* pcts[0] is the median, pcts[2] the 99th percentile */
+		printf("  %8.0f%8.0f%6.0f%%%9.0f%9.0f%9.0f%9.0f %s\n", kops, akops,
+				100.0 * (1.0 - akops / kops),
+				stats[i].antag_lat[0][0], stats[i].antag_lat[1][0],
+				stats[i].antag_lat[0][2], stats[i].antag_lat[1][2],
+				stats[i].filename);
+	}
+}
+
+/*
+ * printcost - prints the abstract work per op of each trace, its cost
+ *    score per op and in total, next to the timed throughput
+ */
+static void printcost(int n, stats_t *stats)
+{
+	int i;
+	double ops, sumscore = 0, sumops = 0;
+
+	printf("  %8s%8s%8s%8s%8s%9s%12s%9s %s\n", "nodes", "reads", "writes",
+			"bytes", "ext", "score", "total", "Kops", "trace");
+	for (i = 0; i < n; i++) {
+		if (!stats[i].valid || stats[i].ops == 0)
+			continue;
+		ops = stats[i].ops;
+		printf("  %8.2f%8.2f%8.2f%8.2f%8.4f%9.2f%12.0f%9.0f %s\n",
+				stats[i].cost.nodes / ops, stats[i].cost.reads / ops,
+				stats[i].cost.writes / ops, stats[i].cost.bytes / ops,
+				stats[i].cost.extends / ops, COST_SCORE(stats[i].cost) / ops,
+				COST_SCORE(stats[i].cost), ops / 1e3 / stats[i].secs,
+				stats[i].filename);
+		sumscore += COST_SCORE(stats[i].cost);
+		sumops += ops;
+	}
+	if (sumops > 0)
+		printf("  %40s%9.2f%12.0f\n", "", sumscore / sumops, sumscore);
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1418,4 +2088,9 @@ static void usage(void)
 	fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
 	fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
 	fprintf(stderr, "\t-j         Use <stdin> as the trace file.\n");
+	fprintf(stderr, "\t-b         Report latency with the background worker off and on.\n");
+	fprintf(stderr, "\t-F         Count the heap and metadata pages a forked child copies on write.\n");
+	fprintf(stderr, "\t-m <t,..>  Replay traces t,.. in -t <dir> interleaved round robin in one heap.\n");
+	fprintf(stderr, "\t-w <t:w,..> Same, picking each request's trace at random by weight w.\n");
+	fprintf(stderr, "\t-a <blt>   Time again next to bandwidth, LLC and/or TLB antagonists.\n");
 }
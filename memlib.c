@@ -31,6 +31,7 @@ void mem_init(void){
 			MAP_PRIVATE,			/* private or shared? */
 			dev_zero,				/* fd */
 			0);						/* offset (dunno) */
+	close(dev_zero);				/* the mapping keeps its own reference */
 	mem_max_addr = heap + MAX_HEAP;
 	mem_brk = heap;					/* heap is empty initially */
 }
@@ -42,6 +43,15 @@ void mem_deinit(void){
 	munmap(heap, MAX_HEAP);
 }
 
+/*
+ * mem_remap - unmap the heap and map it again, empty and with no page
+ *		faulted in, as a freshly started process would see it
+ */
+void mem_remap(void){
+	mem_deinit();
+	mem_init();
+}
+
 /*
  * mem_reset_brk - reset the simulated brk pointer to make an empty heap
  */
@@ -2,6 +2,7 @@
 
 void mem_init(void);               
 void mem_deinit(void);
+void mem_remap(void);
 void *mem_sbrk(int incr);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
@@ -5,9 +5,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#if defined(MM_PERCPU) && defined(__x86_64__)
+# include <sys/rseq.h>
+#endif
 
 #include "mm.h"
+#include "mm_inline.h"
 #include "memlib.h"
+#include "config.h"
 
 #define DEBUG
 #ifdef DEBUG
@@ -38,18 +46,31 @@
 /* store the size and the allocated bit in one word  */
 #define PACK(size, alloc) ((size) | (alloc))
 
+/* counters of abstract work, built with -DMM_COST */
+#ifdef MM_COST
+static mm_cost_t cost;
+# define COST(field, n) (cost.field += (n))
+#else
+# define COST(field, n) ((void)0)
+#endif
+
 /* read and write a word at address p */
-#define READ(p)       (*(unsigned int *)(p))
-#define WRITE(p, val) (*(unsigned int *)(p) = (val))
+#define READ(p)       (COST(reads, 1), *(unsigned int *)(p))
+#define WRITE(p, val) (COST(writes, 1), *(unsigned int *)(p) = (val))
 
 /* read the header info from address p */
 #define GET_SIZE(p)     (READ(p) & ~0x7)
 #define GET_ALLOC(p)    (READ(p) & 0x1)
 #define GET_PREALLOC(p) (READ(p) & 0x2)
+#define GET_TAGGED(p)   (READ(p) & 0x4)
 
 /* speed optimization of the prealloc bit */
-#define SET_PREALLOC(p) (*(unsigned int *)(p) |= 2)
-#define RESET_PREALLOC(p) (*(unsigned int *)(p) &= (~0x2))
+#define SET_PREALLOC(p) (COST(writes, 1), *(unsigned int *)(p) |= 2)
+#define RESET_PREALLOC(p) (COST(writes, 1), *(unsigned int *)(p) &= (~0x2))
+#define SET_TAGGED(p) (COST(writes, 1), *(unsigned int *)(p) |= 4)
+
+/* blocks carved from a superblock are the only allocated ones without the bit */
+#define HOARD_OBJ(bp) (!GET_ALLOC(GET_HEADER(bp)))
 
 /* given block ptr bp, compute address of header and footer */
 #define GET_HEADER(bp) ((char *)(bp) - WSIZE)
@@ -74,25 +95,248 @@
 #define MAX_FIT 6
 #define MAX_NFIT 28
 
+/*
+ * NEXT_FIT: start each search at the rover instead of at the head of the
+ * list, take the first fit, wrapping around once. The rover rests on what
+ * the last placement split off, right behind the block it handed out, so
+ * consecutive allocations land next to each other.
+ * Build with -DNEXT_FIT=1 to turn it on.
+ */
+#ifndef NEXT_FIT
+# define NEXT_FIT 0
+#endif
+
+/*
+ * CALLSITE_GROUPS: hash the caller's return address into this many
+ * placement groups, each with its own free list and its own spans of
+ * 1 << SPAN_SHIFT bytes. A group whose live bytes fall below
+ * 1 / SPARSE_RATIO of the heap its spans cover is merged into group 0,
+ * once it claims a span itself or has been idle since the last claim.
+ * 0 turns the mode off, build with -DCALLSITE_GROUPS=8 to turn it on.
+ */
+#ifndef CALLSITE_GROUPS
+# define CALLSITE_GROUPS 0
+#endif
+#define SPAN_SHIFT 12
+#define SPARSE_RATIO 4
+
+/*
+ * WILDERNESS: serve requests with no fit by bumping them off the last
+ * block of the heap, which grows by at least WILD_CHUNK bytes at a time.
+ * Saves the list traffic of extending, at some utilization: the pre-grown
+ * tail counts against it, and so do placements the list would have made
+ * elsewhere. Build with -DWILDERNESS=1 to turn it on, the call-site
+ * groups claim their spans from it and turn it on themselves.
+ */
+#ifndef WILDERNESS
+# define WILDERNESS (CALLSITE_GROUPS != 0)
+#endif
+#ifndef WILD_CHUNK
+# define WILD_CHUNK (1 << 12)
+#endif
+
+#if CALLSITE_GROUPS && !WILDERNESS
+# error "CALLSITE_GROUPS claims spans off the wilderness, build with WILDERNESS=1"
+#endif
+#if NEXT_FIT && CALLSITE_GROUPS
+# error "NEXT_FIT keeps one rover and cannot walk the per group lists"
+#endif
+
+/* set while the background worker shares the heap with the caller */
+static volatile int bg_running;
+/* set while free queues blocks for the worker and malloc takes stocked ones */
+static volatile int bg_queue;
+static void _worker_join(void);
+static void _worker_reset(void);
+
+/*
+ * build with -DMM_THREADS to serialize the public entry points on one
+ * heap lock; the single-threaded driver build only takes it while the
+ * background worker runs
+ */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+#ifdef MM_THREADS
+# define LOCK()   pthread_mutex_lock(&heap_lock)
+# define UNLOCK() pthread_mutex_unlock(&heap_lock)
+#else
+# define LOCK()   (bg_running? pthread_mutex_lock(&heap_lock) : 0)
+# define UNLOCK() (bg_running? pthread_mutex_unlock(&heap_lock) : 0)
+#endif
+
+/* block size for a request of size bytes, header included */
+#define ADJUST_SIZE(size) MAX(ESIZE, DSIZE * (((size) + WSIZE + DSIZE - 1) / DSIZE))
+
+/* parameters of the per cpu caches, built with -DMM_PERCPU on x86-64 */
+#define MAX_CPUS 64
+#define CPU_CLASSES 16 /* cached block sizes: ESIZE .. CPU_CLASSES * DSIZE */
+#define CPU_DEPTH 32   /* blocks per class and cpu */
+#define CPU_BATCH 16   /* blocks moved per refill or flush */
+#if defined(MM_PERCPU) && !defined(MM_THREADS)
+# error "MM_PERCPU refills from the list under the heap lock, build with MM_THREADS"
+#endif
+#if defined(MM_PERCPU) && defined(__x86_64__)
+static void _cpu_reset(void);
+#endif
+
+/* parameters of the superblock heaps, built with -DMM_HOARD */
+#define HOARD_HEAPS 16   /* heap 0 is the global heap, threads share 1 .. 15 */
+#define HOARD_CLASSES 32 /* block sizes: ESIZE .. HOARD_CLASSES * DSIZE */
+#define SB_SIZE (1 << 13)
+#define HOARD_K 4        /* superblocks of slack a heap may always keep */
+#define HOARD_F 4        /* and 1 / HOARD_F of what it holds may be free */
+#ifdef MM_HOARD
+# if defined(MM_PERCPU)
+#  error "MM_HOARD and MM_PERCPU both own the small blocks"
+# endif
+# ifndef MM_THREADS
+#  error "MM_HOARD takes superblocks from the list under the heap lock, build with MM_THREADS"
+# endif
+static void _hoard_free(void *ptr);
+static void _hoard_reset(void);
+#endif
+
+/* parameters of the out of band metadata, built with -DMM_METAPAGES */
+#define META_PAGE_SHIFT 12
+#define META_PAGE (1 << META_PAGE_SHIFT)
+#define META_CHUNK (16 * META_PAGE) /* class pages taken from the list at a time */
+#define META_MAX 2048               /* larger blocks keep in band headers */
+#ifdef MM_METAPAGES
+# if defined(MM_PERCPU) || defined(MM_HOARD)
+#  error "MM_METAPAGES serves the small blocks itself"
+# endif
+static int _meta_free(void *ptr);
+static void _meta_reset(void);
+#endif
+
+/* parameters of the lock-free class stacks, built with -DMM_LFSTACKS */
+#define LF_CLASSES 32 /* stacked block sizes: ESIZE .. LF_CLASSES * DSIZE */
+#define LF_DEPTH 256  /* blocks stacked per class, roughly */
+#ifdef MM_LFSTACKS
+# if defined(MM_HOARD) || defined(MM_METAPAGES)
+#  error "MM_LFSTACKS stacks blocks of the list allocator only"
+# endif
+static void _lf_reset(void);
+#endif
+
+/* parameters of the background worker */
+#define STOCK_CLASSES 32 /* stocked block sizes: ESIZE .. STOCK_CLASSES * DSIZE */
+#define STOCK_DEPTH 32   /* ready blocks kept per class */
+#define WORKER_NAP 20000 /* idle sleep in ns */
+
+/* parameters of the epoch based reclamation */
+#define MAX_THREADS 64
+#define RETIRE_BATCH 64
+#define NEPOCHS 3
+
 /* pointer to the first and last (unused) block of the heap */
 static char *heap_ptr, *heap_end;
 
+#if WILDERNESS
+/*
+ * the wilderness: the last block before the epilogue, marked allocated
+ * and never in the list. Requests with no fit are bumped off its front,
+ * freed blocks next to it are folded back. With size 0 it is the epilogue.
+ */
+static char *wild;
+#endif
+
 /* doubly linked list, maintain all free blocks */
 static char *free_blks;
 
+#if CALLSITE_GROUPS
+#define NSPANS ((MAX_HEAP >> SPAN_SHIFT) + 1)
+#define UNOWNED 0xff
+
+/* span of a block, and the group owning it */
+#define SPAN(bp) (((char *)(bp) - heap_ptr) >> SPAN_SHIFT)
+#define GROUP_OF(bp) (span_owner[SPAN(bp)] == UNOWNED? 0 : span_owner[SPAN(bp)])
+
+/* one free list per group, a block is on the list of its span's owner */
+static char *free_lists[CALLSITE_GROUPS];
+static char *free_tails[CALLSITE_GROUPS];        /* last block of each list */
+static unsigned char span_owner[NSPANS];
+static unsigned char group_map[CALLSITE_GROUPS]; /* hash slot -> group */
+static long group_live[CALLSITE_GROUPS];         /* allocated bytes */
+static long group_owned[CALLSITE_GROUPS];        /* heap bytes of its spans below the wilderness */
+static char group_idle[CALLSITE_GROUPS];         /* no request since the last claim */
+static int cur_group;                            /* group of the request being served */
+
+/* placement group of a call site, a multiplicative hash of its address */
+static int _callsite_group(void *site) {
+    unsigned long h = ((unsigned long)site >> 2) * 0x9E3779B97F4A7C15UL;
+    return group_map[(h >> 32) % CALLSITE_GROUPS];
+}
+
+/* add sign times the bytes of [from, to) to the groups owning their spans */
+static void _own_range(char *from, char *to, int sign) {
+    for (long sp = SPAN(from); from < to; sp++) {
+        char *end = MIN(heap_ptr + ((sp + 1) << SPAN_SHIFT), to);
+        if (span_owner[sp] != UNOWNED) {
+            group_owned[span_owner[sp]] += sign * (end - from);
+        }
+        from = end;
+    }
+}
+
+# define FREE_LIST(bp) free_lists[GROUP_OF(bp)]
+# define CUR_FREE_LIST free_lists[cur_group]
+# define CALLSITE() __builtin_return_address(0)
+# define SET_GROUP(site) (cur_group = _callsite_group(site))
+# define RESET_GROUP() (cur_group = 0)
+#else
+# define FREE_LIST(bp) free_blks
+# define CUR_FREE_LIST free_blks
+# define CALLSITE() NULL
+# define SET_GROUP(site) ((void)(site))
+# define RESET_GROUP() ((void)0)
+#endif
+
+#if NEXT_FIT
+/* where the next search starts */
+static char *rover;
+#endif
+
+/* base of the public 32-bit references, equal to heap_ptr */
+char *mm_ref32_base;
+
+/* bumped by mm_init, lets per thread state notice a reset heap */
+volatile unsigned long mm_heap_gen;
+
+/*
+ * per thread deltas of the tag counters, kept in static slots (the heap
+ * may be reset under them) so mm_tag_stats can sum them without flushing
+ */
+typedef struct {
+    volatile int used;
+    volatile unsigned long gen;
+    long live_bytes[MM_MAX_TAGS];
+    long allocs[MM_MAX_TAGS];
+    long frees[MM_MAX_TAGS];
+} tag_cache_t;
+
+static tag_cache_t tag_caches[MAX_THREADS];
+static tag_cache_t tag_retired; /* deltas of exited threads */
+static pthread_mutex_t tag_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t tag_key;
+static pthread_once_t tag_once = PTHREAD_ONCE_INIT;
+static __thread tag_cache_t *my_tags;
+
 /* insert a free block to the front of the list */
 static void _insert_free_block(void *ptr) {
     if (ptr == NULL) {
         return;
     }
-    if (free_blks == NULL) {
-        free_blks = ptr;
+    if (FREE_LIST(ptr) == NULL) {
+        FREE_LIST(ptr) = ptr;
         SET_PRED_FREE(ptr, 0);
         SET_SUCC_FREE(ptr, 0);
+#if CALLSITE_GROUPS
+        free_tails[GROUP_OF(ptr)] = ptr;
+#endif
     } else {
-        SET_SUCC_FREE(ptr, free_blks);
-        SET_PRED_FREE(free_blks, ptr);
-        free_blks = ptr;
+        SET_SUCC_FREE(ptr, FREE_LIST(ptr));
+        SET_PRED_FREE(FREE_LIST(ptr), ptr);
+        FREE_LIST(ptr) = ptr;
         SET_PRED_FREE(ptr, 0);
     }
 }
@@ -103,12 +347,22 @@ static void _delete_free_block(void *ptr) {
         return;
     }
     void *succ_free = SUCC_FREE(ptr);
-    if (free_blks == ptr) {
+#if NEXT_FIT
+    if (rover == ptr) {
+        rover = succ_free;
+    }
+#endif
+#if CALLSITE_GROUPS
+    if (succ_free == NULL) {
+        free_tails[GROUP_OF(ptr)] = (char *)PRED_FREE(ptr);
+    }
+#endif
+    if (FREE_LIST(ptr) == ptr) {
         if (succ_free == NULL) {
-            free_blks = NULL;
+            FREE_LIST(ptr) = NULL;
         } else {
-            free_blks = succ_free;
-            SET_PRED_FREE(free_blks, 0);
+            FREE_LIST(ptr) = succ_free;
+            SET_PRED_FREE(FREE_LIST(ptr), 0);
         }
     } else {
         void *pred_free = PRED_FREE(ptr);
@@ -121,8 +375,38 @@ static void _delete_free_block(void *ptr) {
     }
 }
 
-/* when a block becomes free, try to merge it with neighboring blocks if they are free */
+#if WILDERNESS
+/* fold a free block, and its free predecessor, into the wilderness */
+static void _wild_absorb(void *ptr) {
+    size_t size = GET_SIZE(GET_HEADER(ptr)) + GET_SIZE(GET_HEADER(wild));
+    if (!GET_PREALLOC(GET_HEADER(ptr))) {
+        char *pred = PRED_BLK(ptr);
+        _delete_free_block(pred);
+        size += GET_SIZE(GET_HEADER(pred));
+        ptr = pred;
+    }
+    WRITE(GET_HEADER(ptr), PACK(size, GET_PREALLOC(GET_HEADER(ptr)) | 1));
+#if CALLSITE_GROUPS
+    _own_range(ptr, wild, -1);
+    for (long sp = SPAN(ptr) + 1; sp <= SPAN(wild); sp++) { //no block starts there any more
+        span_owner[sp] = UNOWNED;
+    }
+#endif
+    wild = ptr;
+}
+#endif
+
+/*
+ * when a block becomes free, try to merge it with neighboring blocks if they are free
+ * a block next to the wilderness is folded into it instead, NULL is returned
+ */
 static void *_merge_free_blocks(void *ptr) {
+#if WILDERNESS
+    if (SUCC_BLK(ptr) == wild) {
+        _wild_absorb(ptr);
+        return NULL;
+    }
+#endif
     size_t pred_alloc = GET_PREALLOC(GET_HEADER(ptr));
     size_t succ_alloc = GET_ALLOC(SUCC_HEADER(ptr));
     if (pred_alloc && succ_alloc) {
@@ -177,6 +461,22 @@ static void _build(void *ptr, size_t size) {
     }
 }
 
+#if WILDERNESS
+/* ask for more space, the wilderness grows by at least extend_size bytes */
+static int _extend_heap(size_t extend_size) {
+    extend_size = ALIGN(MAX(extend_size, WILD_CHUNK));
+    if (mem_sbrk(extend_size) == (void *)-1) {
+        return 0;
+    }
+    COST(extends, 1);
+    size_t size = GET_SIZE(GET_HEADER(wild)) + extend_size;
+    size_t prealloc = GET_PREALLOC(GET_HEADER(wild));
+    WRITE(GET_HEADER(wild), PACK(size, prealloc | 1));
+    heap_end = GET_HEADER(SUCC_BLK(wild));
+    WRITE(heap_end, PACK(0, 3));
+    return 1;
+}
+#else
 /* ask for more space */
 static void *_extend_heap(size_t extend_size) {
     extend_size = (extend_size & 1)? ((extend_size + 1) * WSIZE) : (extend_size * WSIZE);
@@ -184,6 +484,7 @@ static void *_extend_heap(size_t extend_size) {
     if (ptr == (void *)-1) {
         return NULL;
     }
+    COST(extends, 1);
     size_t prealloc = GET_PREALLOC(heap_end);
     WRITE(GET_HEADER(ptr), PACK(extend_size, prealloc));
     WRITE(GET_FOOTER(ptr), PACK(extend_size, 0));
@@ -191,7 +492,135 @@ static void *_extend_heap(size_t extend_size) {
     WRITE(heap_end, PACK(0, 1));
     return _merge_free_blocks(ptr);
 }
+#endif
+
+#if CALLSITE_GROUPS
+/* move group g, its hash slots, spans, bytes and free blocks, into group into */
+static void _merge_group(int g, int into) {
+    for (int h = 0; h < CALLSITE_GROUPS; h++) {
+        if (group_map[h] == g) {
+            group_map[h] = into;
+        }
+    }
+    for (long sp = 0; sp <= SPAN(wild); sp++) {
+        if (span_owner[sp] == g) {
+            span_owner[sp] = into;
+        }
+    }
+    group_live[into] += group_live[g];
+    group_owned[into] += group_owned[g];
+    group_live[g] = group_owned[g] = 0;
+    if (free_lists[g] != NULL) { //g's list goes in front of into's
+        SET_SUCC_FREE(free_tails[g], free_lists[into]);
+        if (free_lists[into] != NULL) {
+            SET_PRED_FREE(free_lists[into], free_tails[g]);
+        } else {
+            free_tails[into] = free_tails[g];
+        }
+        free_lists[into] = free_lists[g];
+        free_lists[g] = free_tails[g] = NULL;
+    }
+    if (cur_group == g) {
+        cur_group = into;
+    }
+}
+
+/*
+ * give the spans of the block bumped at [from, to) nobody owns to the
+ * current group, and count the block. A new span is a good time to look
+ * for sparse groups, however many spans they own.
+ */
+static void _claim_spans(char *from, char *to) {
+    int claimed = 0;
+    for (long sp = SPAN(from); sp <= SPAN(to); sp++) {
+        if (span_owner[sp] == UNOWNED) {
+            span_owner[sp] = cur_group;
+            claimed = 1;
+        }
+    }
+    _own_range(from, to, 1);
+    group_live[GROUP_OF(from)] += to - from;
+    if (!claimed) {
+        return;
+    }
+    for (int g = 1; g < CALLSITE_GROUPS; g++) { //a busy group may still fill its spans
+        if ((g == cur_group || group_idle[g]) && group_live[g] * SPARSE_RATIO < group_owned[g]) {
+            _merge_group(g, 0);
+        }
+        group_idle[g] = 1;
+    }
+}
+
+/*
+ * before bumping, make sure the wilderness starts in a span of the current
+ * group: the rest of a span owned by another group becomes a free block
+ * on that group's list. It is the one free block that can sit right before
+ * the wilderness, whose prealloc bit then says so: _wild_alloc hands the
+ * bit on to the block it bumps, and _wild_absorb folds the gap back in
+ * once that block is freed. The groups share the span when the carve
+ * would leave its owner sparse.
+ */
+static int _wild_skip(size_t size) {
+    int owner = span_owner[SPAN(wild)];
+    if (owner == UNOWNED || owner == cur_group) {
+        return 1;
+    }
+    char *next = heap_ptr + ((SPAN(wild) + 1) << SPAN_SHIFT);
+    size_t gap = next - wild;
+    if (gap < ESIZE) { //too small to carve
+        return 1;
+    }
+    if (group_live[owner] * SPARSE_RATIO < group_owned[owner] + (long)gap) {
+        return 1;
+    }
+    size_t wild_size = GET_SIZE(GET_HEADER(wild));
+    if (wild_size < gap + size) {
+        if (!_extend_heap(gap + size - wild_size)) {
+            return 0;
+        }
+        wild_size = GET_SIZE(GET_HEADER(wild));
+    }
+    char *ptr = wild;
+    wild = next;
+    group_owned[owner] += gap;
+    WRITE(GET_HEADER(wild), PACK(wild_size - gap, 1));
+    WRITE(GET_HEADER(ptr), PACK(gap, 2));
+    WRITE(GET_FOOTER(ptr), PACK(gap, 0));
+    _insert_free_block(ptr);
+    return 1;
+}
+#endif
+
+#if WILDERNESS
+/*
+ * no fit: bump the block off the front of the wilderness, one header for
+ * the block and one for what is left, no list traffic
+ */
+static void *_wild_alloc(size_t size) {
+#if CALLSITE_GROUPS
+    if (!_wild_skip(size)) {
+        return NULL;
+    }
+#endif
+    size_t wild_size = GET_SIZE(GET_HEADER(wild));
+    if (wild_size < size) {
+        if (!_extend_heap(size - wild_size)) {
+            return NULL;
+        }
+        wild_size = GET_SIZE(GET_HEADER(wild));
+    }
+    char *ptr = wild;
+    WRITE(GET_HEADER(ptr), PACK(size, GET_PREALLOC(GET_HEADER(ptr)) | 1));
+    wild = ptr + size;
+    WRITE(GET_HEADER(wild), PACK(wild_size - size, 3));
+#if CALLSITE_GROUPS
+    _claim_spans(ptr, wild);
+#endif
+    return ptr;
+}
+#endif
 
+#if !NEXT_FIT
 /* 
  * fit strategy: find the best fit among the first MAX_FIT fits
  * if already found a fit and more than MAX_NFIT unfit blocks, return immediately
@@ -200,7 +629,8 @@ static void *_allocate(size_t size) {
     char *best_fit = NULL;
     size_t best_fit_size = 0;
     int fit_cnt = 0, nfit_cnt = 0;
-    for (void* ptr = free_blks; ptr != NULL; ptr = SUCC_FREE(ptr)) {
+    for (void* ptr = CUR_FREE_LIST; ptr != NULL; ptr = SUCC_FREE(ptr)) {
+        COST(nodes, 1);
         size_t now_size = GET_SIZE(GET_HEADER(ptr));
         if (now_size >= size) {
             if (best_fit == NULL || now_size < best_fit_size) {
@@ -221,11 +651,52 @@ static void *_allocate(size_t size) {
     }
     return NULL;
 }
+#endif
+
+#if NEXT_FIT
+/*
+ * next fit strategy: the first fit from the rover on, the blocks skipped
+ * at the front of the list are not scanned again on every request
+ */
+static void *_allocate_next(size_t size) {
+    char *start = rover != NULL? rover : free_blks;
+    if (start == NULL) {
+        return NULL;
+    }
+    void *ptr = start;
+    do {
+        COST(nodes, 1);
+        if (GET_SIZE(GET_HEADER(ptr)) >= size) {
+            return ptr;
+        }
+        ptr = SUCC_FREE(ptr);
+        if (ptr == NULL) {
+            ptr = free_blks;
+        }
+    } while (ptr != start);
+    return NULL;
+}
+#endif
 
 /*
  * mm_init - Called when a new trace starts.
  */
 int mm_init(void) {
+    if (bg_running) {
+        bg_queue = 0;
+        _worker_join();
+        _worker_reset();
+        bg_running = 0;
+    }
+#if defined(MM_PERCPU) && defined(__x86_64__)
+    _cpu_reset();
+#endif
+#ifdef MM_HOARD
+    _hoard_reset();
+#endif
+#ifdef MM_LFSTACKS
+    _lf_reset();
+#endif
     if ((heap_ptr = mem_sbrk(6 * WSIZE)) == (void *)-1) {
         return -1;
     }
@@ -236,83 +707,1747 @@ int mm_init(void) {
     WRITE(heap_ptr + (4 * WSIZE), PACK(ESIZE, 1));
     WRITE(heap_ptr + (5 * WSIZE), PACK(0, 3));
     heap_end = heap_ptr + (5 * WSIZE);
+#if WILDERNESS
+    wild = heap_end + WSIZE;
+#endif
     heap_ptr += ESIZE;
+    mm_ref32_base = heap_ptr;
     free_blks = NULL;
+#if CALLSITE_GROUPS
+    memset(free_lists, 0, sizeof(free_lists));
+    memset(free_tails, 0, sizeof(free_tails));
+    memset(span_owner, UNOWNED, sizeof(span_owner));
+    memset(group_live, 0, sizeof(group_live));
+    memset(group_owned, 0, sizeof(group_owned));
+    memset(group_idle, 0, sizeof(group_idle));
+    for (int g = 0; g < CALLSITE_GROUPS; g++) {
+        group_map[g] = g;
+    }
+    cur_group = 0;
+#endif
+#if NEXT_FIT
+    rover = NULL;
+#endif
+#ifdef MM_METAPAGES
+    _meta_reset();
+#endif
+    mm_heap_gen++;
     return 0;
 }
 
 /*
- * malloc - Allocate a block
+ * _malloc - Allocate a block
  *      If there is a fit in the list, use the fit block.
  *      Otherwise ask for more space from the heap.
  *      Caution: footer is no longer needed for allocated blocks
  */
-void *malloc(size_t size) {
+static void *_malloc(size_t size) {
     if (size == 0) {
         return NULL;
     }
     /* without footer optimization: 
      * size = DSIZE * ((size + DSIZE - 1) / DSIZE + 1);
      */
-    size = MAX(ESIZE, DSIZE * ((size + WSIZE + DSIZE - 1) / DSIZE));
+    size = ADJUST_SIZE(size);
+#if NEXT_FIT
+    char *ptr = _allocate_next(size);
+#else
     char *ptr = _allocate(size);
+#endif
+#if CALLSITE_GROUPS
+    if (ptr == NULL && cur_group != 0) { //group 0 holds the merged groups, shared by all
+        int group = cur_group;
+        cur_group = 0;
+        ptr = _allocate(size);
+        cur_group = group;
+    }
+#endif
     if (ptr != NULL) { //find a fit
         _build(ptr, size);
-        return ptr;
-    } else { //no fit, must extend the heap
-        ptr = _extend_heap(size / WSIZE);
-        if (ptr == NULL) {
+#if CALLSITE_GROUPS
+        group_live[GROUP_OF(ptr)] += GET_SIZE(GET_HEADER(ptr));
+#endif
+#if WILDERNESS
+    } else if ((ptr = _wild_alloc(size)) == NULL) { //no fit, take from the wilderness
         return NULL;
+    }
+#else
+    } else { //no fit, must extend the heap
+        if ((ptr = _extend_heap(size / WSIZE)) == NULL) {
+            return NULL;
         }
         _build(ptr, size);
-        return ptr;
     }
+#endif
+#if CALLSITE_GROUPS
+    group_idle[cur_group] = 0;
+#endif
+#if NEXT_FIT
+    char *split = SUCC_BLK(ptr);
+    if (!GET_ALLOC(GET_HEADER(split))) { //resume at the remainder, never the wilderness
+        rover = split;
+    }
+#endif
+    return ptr;
+}
+
+/* reset the counters of a cache that belong to an older heap */
+static void _tag_sync(tag_cache_t *tc) {
+    if (tc->gen != mm_heap_gen) {
+        memset(tc->live_bytes, 0, sizeof(tc->live_bytes));
+        memset(tc->allocs, 0, sizeof(tc->allocs));
+        memset(tc->frees, 0, sizeof(tc->frees));
+        tc->gen = mm_heap_gen;
+    }
+}
+
+/* fold a thread's deltas into the retired totals when it exits */
+static void _tag_thread_exit(void *arg) {
+    tag_cache_t *tc = arg;
+    pthread_mutex_lock(&tag_lock);
+    _tag_sync(&tag_retired);
+    if (tc->gen == mm_heap_gen) {
+        for (int t = 0; t < MM_MAX_TAGS; t++) {
+            tag_retired.live_bytes[t] += tc->live_bytes[t];
+            tag_retired.allocs[t] += tc->allocs[t];
+            tag_retired.frees[t] += tc->frees[t];
+        }
+    }
+    tc->used = 0;
+    pthread_mutex_unlock(&tag_lock);
+    my_tags = NULL;
+}
+
+static void _tag_key_init(void) {
+    pthread_key_create(&tag_key, _tag_thread_exit);
+}
+
+/* find the calling thread's cache, registering it on first use */
+static tag_cache_t *_tag_cache(void) {
+    if (my_tags != NULL) {
+        return my_tags;
+    }
+    pthread_once(&tag_once, _tag_key_init);
+    pthread_mutex_lock(&tag_lock);
+    for (int i = 0; i < MAX_THREADS; i++) {
+        if (!tag_caches[i].used) {
+            my_tags = &tag_caches[i];
+            my_tags->used = 1;
+            my_tags->gen = mm_heap_gen - 1; //cleared by the first _tag_sync
+            break;
+        }
+    }
+    pthread_mutex_unlock(&tag_lock);
+    if (my_tags == NULL) { //too many threads, charge the shared totals
+        return &tag_retired;
+    }
+    pthread_setspecific(tag_key, my_tags);
+    return my_tags;
+}
+
+/* update the calling thread's counters of a tag, size < 0 for a free */
+static void _tag_account(unsigned int tag, long size) {
+    tag_cache_t *tc = _tag_cache();
+    if (tc == &tag_retired) {
+        pthread_mutex_lock(&tag_lock);
+    }
+    _tag_sync(tc);
+    __atomic_store_n(&tc->live_bytes[tag], tc->live_bytes[tag] + size, __ATOMIC_RELAXED);
+    if (size > 0) {
+        __atomic_store_n(&tc->allocs[tag], tc->allocs[tag] + 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&tc->frees[tag], tc->frees[tag] + 1, __ATOMIC_RELAXED);
+    }
+    if (tc == &tag_retired) {
+        pthread_mutex_unlock(&tag_lock);
+    }
+}
+
+/* mark an allocated block with a tag, kept in its unused footer */
+static void _tag_block(void *ptr, unsigned int tag) {
+    SET_TAGGED(GET_HEADER(ptr));
+    WRITE(GET_FOOTER(ptr), tag);
+    _tag_account(tag, GET_SIZE(GET_HEADER(ptr)));
 }
 
 /*
- * free - Reset the block (especially the footer).
+ * _free - Reset the block (especially the footer).
  *      First merge with neighboring free blocks, then insert to the list
  */
-void free(void *ptr) {
+static void _free(void *ptr) {
     if (ptr == NULL) {
         return;
     }
+#ifdef MM_HOARD
+    if (HOARD_OBJ(ptr)) {
+        _hoard_free(ptr);
+        return;
+    }
+#endif
+#ifdef MM_METAPAGES
+    if (_meta_free(ptr)) {
+        return;
+    }
+#endif
     size_t size = GET_SIZE(GET_HEADER(ptr));
     size_t prealloc = GET_PREALLOC(GET_HEADER(ptr));
+    if (GET_TAGGED(GET_HEADER(ptr))) {
+        _tag_account(READ(GET_FOOTER(ptr)), -(long)size);
+    }
+#if CALLSITE_GROUPS
+    group_live[GROUP_OF(ptr)] -= size;
+#endif
     WRITE(GET_HEADER(ptr), PACK(size, prealloc));
     WRITE(GET_FOOTER(ptr), PACK(size, 0));
     _merge_free_blocks(ptr);
 }
 
+/* release a batch of blocks while taking the heap lock only once */
+static void _free_batch(void **ptrs, int n) {
+    LOCK();
+    for (int i = 0; i < n; i++) {
+        _free(ptrs[i]);
+    }
+    UNLOCK();
+}
+
 /*
- * realloc - Change the size of the block by mallocing a new block,
- *      copying its data, and freeing the old block.
+ * Background worker
+ *      While it runs, free only pushes the block on a lock-free stack
+ *      and the worker merges it later; small requests are served from
+ *      per class stocks of ready blocks that the worker keeps filled.
+ *      Each stock is a ring, the worker appends at tail and the
+ *      foreground pops at head behind a try-lock.
  */
-void *realloc(void *oldptr, size_t size) {
-    if (size == 0) {
-        free(oldptr);
+typedef struct {
+    void *volatile blks[STOCK_DEPTH];
+    volatile unsigned long head, tail;
+    volatile int busy;   /* a foreground thread is popping */
+    volatile int wanted; /* the class has seen requests */
+} stock_t;
+
+static stock_t stocks[STOCK_CLASSES + 1];
+static void *volatile free_queue; /* deferred frees, linked through the payload */
+static volatile int bg_stop;
+static pthread_t bg_thread;
+
+/* take a stocked block for a request, NULL if none is ready */
+static void *_stock_pop(size_t size) {
+    size_t asize = ADJUST_SIZE(size);
+    if (asize > STOCK_CLASSES * DSIZE) {
+        return NULL;
+    }
+    stock_t *st = &stocks[asize / DSIZE];
+    if (!st->wanted) {
+        st->wanted = 1;
+    }
+    if (__sync_lock_test_and_set(&st->busy, 1)) {
+        return NULL;
+    }
+    void *ptr = NULL;
+    unsigned long head = st->head;
+    if (head != __atomic_load_n(&st->tail, __ATOMIC_ACQUIRE)) {
+        ptr = st->blks[head % STOCK_DEPTH];
+        __atomic_store_n(&st->head, head + 1, __ATOMIC_RELEASE);
+    }
+    __sync_lock_release(&st->busy);
+    return ptr;
+}
+
+/* hand a block to the worker */
+static void _queue_push(void *ptr) {
+    void *old;
+    do {
+        old = free_queue;
+        *(void **)ptr = old;
+    } while (!__sync_bool_compare_and_swap(&free_queue, old, ptr));
+}
+
+/* merge every queued block, return whether there was any */
+static int _worker_drain(void) {
+    void *ptr = __sync_lock_test_and_set(&free_queue, NULL);
+    if (ptr == NULL) {
         return 0;
     }
-    if(oldptr == NULL) {
-        return malloc(size);
+    LOCK();
+    while (ptr != NULL) {
+        void *next = *(void **)ptr;
+        _free(ptr);
+        ptr = next;
+    }
+    UNLOCK();
+    return 1;
+}
+
+/* top up the stocks of the classes in demand, return whether any moved */
+static int _worker_refill(void) {
+    int work = 0;
+    for (int c = ESIZE / DSIZE; c <= STOCK_CLASSES; c++) {
+        stock_t *st = &stocks[c];
+        unsigned long tail = st->tail;
+        if (!st->wanted || tail - __atomic_load_n(&st->head, __ATOMIC_ACQUIRE) == STOCK_DEPTH) {
+            continue;
+        }
+        LOCK();
+        while (tail - __atomic_load_n(&st->head, __ATOMIC_ACQUIRE) < STOCK_DEPTH) {
+            void *ptr = _malloc(c * DSIZE - WSIZE);
+            if (ptr == NULL) {
+                break;
+            }
+            st->blks[tail % STOCK_DEPTH] = ptr;
+            __atomic_store_n(&st->tail, ++tail, __ATOMIC_RELEASE);
+        }
+        UNLOCK();
+        work = 1;
+    }
+    return work;
+}
+
+static void *_worker(void *arg) {
+    struct timespec nap = {0, WORKER_NAP};
+    (void)arg;
+    while (!bg_stop) {
+        int work = _worker_drain();
+        work |= _worker_refill();
+        if (!work) {
+            nanosleep(&nap, NULL);
+        }
+    }
+    return NULL;
+}
+
+/* stop the worker thread, leaving the queue and the stocks as they are */
+static void _worker_join(void) {
+    bg_stop = 1;
+    pthread_join(bg_thread, NULL);
+}
+
+/* forget the queue and the stocks, their blocks belong to a dead heap */
+static void _worker_reset(void) {
+    free_queue = NULL;
+    for (int c = 0; c <= STOCK_CLASSES; c++) {
+        stocks[c].head = stocks[c].tail = 0;
+        stocks[c].wanted = 0;
     }
-    void *newptr = malloc(size);
-    size_t oldsize = GET_SIZE(GET_HEADER(oldptr));
-    size_t newsize = GET_SIZE(GET_HEADER(newptr));
-    size_t cpysize = MIN(oldsize, newsize);
-    memcpy(newptr, oldptr, cpysize - WSIZE);
-    free(oldptr);
-    return newptr;
 }
 
 /*
- * calloc - Allocate the block and set it to zero.
+ * mm_worker_start - Start the background worker.
+ *      Stop it before the heap is reset, mm_init only discards its state.
  */
-void *calloc (size_t nmemb, size_t size) {
-    size_t bytes = nmemb * size;
-    void *newptr = malloc(bytes);
-    memset(newptr, 0, bytes);
-    return newptr;
+int mm_worker_start(void) {
+    if (bg_running) {
+        return 0;
+    }
+    bg_stop = 0;
+    bg_running = 1;
+    if (pthread_create(&bg_thread, NULL, _worker, NULL) != 0) {
+        bg_running = 0;
+        return -1;
+    }
+    bg_queue = 1;
+    return 0;
+}
+
+/*
+ * mm_worker_stop - Stop the worker and give every queued and stocked
+ *      block back to the heap. Other threads may keep allocating: new
+ *      requests bypass the queue and the stocks first, a free that still
+ *      queued its block drains the queue itself.
+ */
+void mm_worker_stop(void) {
+    if (!bg_running) {
+        return;
+    }
+    bg_queue = 0;
+    __sync_synchronize();
+    _worker_join();
+    _worker_drain();
+    LOCK();
+    for (int c = ESIZE / DSIZE; c <= STOCK_CLASSES; c++) {
+        stock_t *st = &stocks[c];
+        while (__sync_lock_test_and_set(&st->busy, 1)) { //a late pop is still in flight
+            sched_yield();
+        }
+        for (; st->head != st->tail; st->head++) {
+            _free(st->blks[st->head % STOCK_DEPTH]);
+        }
+        st->wanted = 0;
+        __sync_lock_release(&st->busy);
+    }
+    UNLOCK();
+    bg_running = 0;
+}
+
+/*
+ * Per cpu caches
+ *      Small blocks are cached per cpu and per size class. Push and pop
+ *      are Linux restartable sequences: the kernel restarts them when the
+ *      thread is preempted or migrated before the commit store, so they
+ *      need no atomics. Misses and overflows go to the locked heap in
+ *      batches. Cached memory scales with the cpus, not the threads.
+ */
+#if defined(MM_PERCPU) && defined(__x86_64__)
+
+typedef struct {
+    long count;
+    void *slots[CPU_DEPTH];
+} cpu_class_t;
+
+typedef struct {
+    cpu_class_t classes[CPU_CLASSES + 1];
+} __attribute__((aligned(64))) cpu_cache_t;
+
+static cpu_cache_t cpu_caches[MAX_CPUS];
+static int percpu_on = -1; /* -1 until rseq has been checked */
+
+enum { RSEQ_OK, RSEQ_MISS, RSEQ_ABORT };
+
+/* the rseq area glibc registered for the calling thread */
+static struct rseq *_rseq_area(void) {
+    return (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+}
+
+/* descriptor of the critical section between labels 1 and 2, abort at 4 */
+#define RSEQ_CS_BEGIN \
+    ".pushsection __rseq_cs, \"aw\"\n\t" \
+    ".balign 32\n\t" \
+    "3:\n\t" \
+    ".long 0x0, 0x0\n\t" \
+    ".quad 1f, (2f - 1f), 4f\n\t" \
+    ".popsection\n\t" \
+    "leaq 3b(%%rip), %%rax\n\t" \
+    "movq %%rax, %[rseq_cs]\n\t" \
+    "1:\n\t" \
+    "cmpl %[cpu], %[cpu_id]\n\t" \
+    "jnz 4f\n\t"
+
+#define RSEQ_CS_END \
+    "2:\n\t" \
+    ".pushsection __rseq_failure, \"ax\"\n\t" \
+    ".long 0x53053053\n\t" /* RSEQ_SIG */ \
+    "4:\n\t" \
+    "movl $2, %[rc]\n\t" \
+    "jmp 2b\n\t" \
+    ".popsection\n\t"
+
+/* pop the top of cc if the thread is still on cpu, committed by the count store */
+static int _rseq_pop(struct rseq *rs, unsigned int cpu, cpu_class_t *cc, void **out) {
+    int rc;
+    void *ptr = NULL;
+    asm volatile(
+        RSEQ_CS_BEGIN
+        "movq %[count], %%rax\n\t"
+        "movl $1, %[rc]\n\t"
+        "testq %%rax, %%rax\n\t"
+        "jz 2f\n\t"
+        "subq $1, %%rax\n\t"
+        "movq (%[slots], %%rax, 8), %[ptr]\n\t"
+        "movl $0, %[rc]\n\t"
+        "movq %%rax, %[count]\n\t"
+        RSEQ_CS_END
+        : [rc] "=&r" (rc), [ptr] "+&r" (ptr), [count] "+m" (cc->count),
+          [rseq_cs] "=m" (rs->rseq_cs)
+        : [cpu] "r" (cpu), [cpu_id] "m" (rs->cpu_id), [slots] "r" (cc->slots)
+        : "rax", "memory", "cc");
+    *out = ptr;
+    return rc;
+}
+
+/* push ptr on cc if the thread is still on cpu and there is room */
+static int _rseq_push(struct rseq *rs, unsigned int cpu, cpu_class_t *cc, void *ptr) {
+    int rc;
+    asm volatile(
+        RSEQ_CS_BEGIN
+        "movq %[count], %%rax\n\t"
+        "movl $1, %[rc]\n\t"
+        "cmpq %[depth], %%rax\n\t"
+        "jae 2f\n\t"
+        "movq %[ptr], (%[slots], %%rax, 8)\n\t"
+        "addq $1, %%rax\n\t"
+        "movl $0, %[rc]\n\t"
+        "movq %%rax, %[count]\n\t"
+        RSEQ_CS_END
+        : [rc] "=&r" (rc), [count] "+m" (cc->count), [rseq_cs] "=m" (rs->rseq_cs)
+        : [cpu] "r" (cpu), [cpu_id] "m" (rs->cpu_id), [slots] "r" (cc->slots),
+          [ptr] "r" (ptr), [depth] "i" (CPU_DEPTH)
+        : "rax", "memory", "cc");
+    return rc;
+}
+
+/* pop a block of class c from the current cpu, NULL on a miss */
+static void *_cpu_pop(int c) {
+    struct rseq *rs = _rseq_area();
+    for (;;) {
+        unsigned int cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED);
+        void *ptr;
+        if (cpu >= MAX_CPUS) {
+            return NULL;
+        }
+        int rc = _rseq_pop(rs, cpu, &cpu_caches[cpu].classes[c], &ptr);
+        if (rc != RSEQ_ABORT) {
+            return rc == RSEQ_OK? ptr : NULL;
+        }
+    }
+}
+
+/* push a block of class c on the current cpu, 0 if the cache is full */
+static int _cpu_push(int c, void *ptr) {
+    struct rseq *rs = _rseq_area();
+    for (;;) {
+        unsigned int cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED);
+        if (cpu >= MAX_CPUS) {
+            return 0;
+        }
+        int rc = _rseq_push(rs, cpu, &cpu_caches[cpu].classes[c], ptr);
+        if (rc != RSEQ_ABORT) {
+            return rc == RSEQ_OK;
+        }
+    }
+}
+
+/* allocate from the cpu cache, refilling it from the heap on a miss */
+static void *_cpu_malloc(size_t size) {
+    if (percpu_on < 0) {
+        percpu_on = __rseq_size != 0;
+    }
+    size_t asize = ADJUST_SIZE(size);
+    if (!percpu_on || asize > CPU_CLASSES * DSIZE) {
+        return NULL;
+    }
+    int c = asize / DSIZE;
+    void *ptr = _cpu_pop(c);
+    if (ptr != NULL) {
+        return ptr;
+    }
+    void *batch[CPU_BATCH];
+    int n = 0;
+    LOCK();
+    while (n < CPU_BATCH && (batch[n] = _malloc(asize - WSIZE)) != NULL) {
+        n++;
+    }
+    UNLOCK();
+    for (int i = 1; i < n; i++) {
+        if (!_cpu_push(c, batch[i])) { //migrated onto a full cache
+            _free_batch(batch + i, n - i);
+            break;
+        }
+    }
+    return n > 0? batch[0] : NULL;
+}
+
+/* cache a freed block, flushing a batch of the cache when it is full */
+static int _cpu_free(void *ptr) {
+    size_t size = GET_SIZE(GET_HEADER(ptr));
+    if (percpu_on <= 0 || size > CPU_CLASSES * DSIZE || GET_TAGGED(GET_HEADER(ptr))) {
+        return 0;
+    }
+    int c = size / DSIZE;
+    if (_cpu_push(c, ptr)) {
+        return 1;
+    }
+    void *batch[CPU_BATCH + 1];
+    int n = 0;
+    while (n < CPU_BATCH && (batch[n] = _cpu_pop(c)) != NULL) {
+        n++;
+    }
+    batch[n++] = ptr;
+    _free_batch(batch, n);
+    return 1;
+}
+
+/* forget the cached blocks, they belong to a dead heap */
+static void _cpu_reset(void) {
+    memset(cpu_caches, 0, sizeof(cpu_caches));
+}
+
+/* give every cached block back, no other thread may be allocating */
+static void _cpu_flush(void) {
+    LOCK();
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        for (int c = 0; c <= CPU_CLASSES; c++) {
+            cpu_class_t *cc = &cpu_caches[cpu].classes[c];
+            while (cc->count > 0) {
+                _free(cc->slots[--cc->count]);
+            }
+        }
+    }
+    UNLOCK();
+}
+
+#endif
+
+/*
+ * Hoard superblocks
+ *      Small blocks are carved from superblocks of SB_SIZE bytes, each
+ *      holding blocks of one class. A thread allocates from the heap it
+ *      was assigned; a freed block goes back to its superblock, whichever
+ *      heap owns it by then. When a heap holds more than HOARD_K
+ *      superblocks of slack and more than 1 / HOARD_F of it is free, a
+ *      superblock at least 1 / HOARD_F free moves to the global heap 0,
+ *      where any heap can take it. A heap thus holds at most
+ *      used / (1 - 1 / HOARD_F) + HOARD_K * SB_SIZE bytes, so memory stays
+ *      within a constant factor of the live peak however the threads
+ *      pass blocks around. Superblocks are never given back to the list.
+ *      A block's header is its offset in the superblock, alloc bit clear.
+ *      Lock order: a thread heap, then heap 0, then the heap lock.
+ */
+#ifdef MM_HOARD
+
+typedef struct sb {
+    struct sb *prev, *next;
+    struct hoard_heap *volatile owner;
+    int cls;         /* block size / DSIZE */
+    int bin;         /* list the superblock is on, -1 while full */
+    int nobjs;       /* blocks that fit */
+    int nfree;       /* blocks not in use */
+    int carved;      /* blocks handed out at least once */
+    void *free_list; /* freed blocks, linked through the payload */
+} sb_t;
+
+/* bins[0] of heap 0 holds the empty superblocks, of any class */
+typedef struct hoard_heap {
+    pthread_mutex_t lock;
+    sb_t *bins[HOARD_CLASSES + 1]; /* superblocks with free blocks */
+    long used;                     /* bytes in blocks in use */
+    long held;                     /* bytes in superblocks */
+} __attribute__((aligned(64))) hoard_heap_t;
+
+static hoard_heap_t hoard_heaps[HOARD_HEAPS] = {
+    [0 ... HOARD_HEAPS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+static volatile int hoard_next; /* round robin assignment of the heaps */
+static __thread int my_heap;    /* 0 until assigned */
+
+/* offset of the first payload, and the superblock of a block */
+#define SB_BASE (ALIGN(sizeof(sb_t)) + DSIZE)
+#define SB_OF(bp) ((sb_t *)((char *)(bp) - READ(GET_HEADER(bp))))
+
+/* a superblock worth giving away, at least 1 / HOARD_F free */
+#define SB_SPARSE(sb) ((sb)->nfree * HOARD_F >= (sb)->nobjs)
+
+/* the heap holds more free space than the bound allows */
+#define HOARD_SLACK(h) ((h)->used < (h)->held - HOARD_K * SB_SIZE && \
+                        (h)->used < (h)->held - (h)->held / HOARD_F)
+
+static void _sb_link(hoard_heap_t *h, sb_t *sb, int bin) {
+    sb->bin = bin;
+    sb->prev = NULL;
+    sb->next = h->bins[bin];
+    if (sb->next != NULL) {
+        sb->next->prev = sb;
+    }
+    h->bins[bin] = sb;
+}
+
+static void _sb_unlink(hoard_heap_t *h, sb_t *sb) {
+    if (sb->prev != NULL) {
+        sb->prev->next = sb->next;
+    } else {
+        h->bins[sb->bin] = sb->next;
+    }
+    if (sb->next != NULL) {
+        sb->next->prev = sb->prev;
+    }
+    sb->bin = -1;
+}
+
+/* lay out an empty superblock for blocks of class c */
+static void _sb_format(sb_t *sb, int c) {
+    sb->cls = c;
+    sb->nobjs = (SB_SIZE - SB_BASE) / (c * DSIZE);
+    sb->nfree = sb->nobjs;
+    sb->carved = 0;
+    sb->free_list = NULL;
+}
+
+/* hand a superblock with free blocks from one heap to another, both locked */
+static void _sb_move(hoard_heap_t *from, hoard_heap_t *to, sb_t *sb, int bin) {
+    long used = (long)(sb->nobjs - sb->nfree) * sb->cls * DSIZE;
+    _sb_unlink(from, sb);
+    from->used -= used;
+    from->held -= SB_SIZE;
+    to->used += used;
+    to->held += SB_SIZE;
+    sb->owner = to;
+    _sb_link(to, sb, bin);
+}
+
+/* take a block from a superblock of the locked heap h */
+static void *_sb_take(hoard_heap_t *h, sb_t *sb) {
+    char *bp = sb->free_list;
+    if (bp != NULL) {
+        sb->free_list = *(void **)bp;
+    } else {
+        bp = (char *)sb + SB_BASE + sb->carved++ * sb->cls * DSIZE;
+        WRITE(GET_HEADER(bp), bp - (char *)sb);
+    }
+    if (--sb->nfree == 0) {
+        _sb_unlink(h, sb);
+    }
+    h->used += sb->cls * DSIZE;
+    return bp;
+}
+
+/*
+ * find a superblock of class c for the locked heap h: one with free
+ * blocks or an empty one from heap 0, else a new one from the list
+ */
+static sb_t *_hoard_fetch(hoard_heap_t *h, int c) {
+    hoard_heap_t *g = &hoard_heaps[0];
+    pthread_mutex_lock(&g->lock);
+    sb_t *sb = g->bins[c] != NULL? g->bins[c] : g->bins[0];
+    if (sb != NULL) {
+        _sb_move(g, h, sb, c);
+        if (sb->cls != c) { //empty, reuse it for this class
+            _sb_format(sb, c);
+        }
+    }
+    pthread_mutex_unlock(&g->lock);
+    if (sb != NULL) {
+        return sb;
+    }
+    pthread_mutex_unlock(&h->lock);
+    LOCK();
+    sb = _malloc(SB_SIZE - WSIZE);
+    UNLOCK();
+    pthread_mutex_lock(&h->lock);
+    if (sb == NULL) {
+        return NULL;
+    }
+    _sb_format(sb, c);
+    sb->owner = h;
+    h->held += SB_SIZE;
+    _sb_link(h, sb, c);
+    return sb;
+}
+
+static void *_hoard_malloc(size_t size) {
+    int c = ADJUST_SIZE(size) / DSIZE;
+    if (my_heap == 0) {
+        my_heap = 1 + __sync_fetch_and_add(&hoard_next, 1) % (HOARD_HEAPS - 1);
+    }
+    hoard_heap_t *h = &hoard_heaps[my_heap];
+    pthread_mutex_lock(&h->lock);
+    sb_t *sb = h->bins[c];
+    if (sb == NULL) {
+        sb = _hoard_fetch(h, c);
+    }
+    void *ptr = sb != NULL? _sb_take(h, sb) : NULL;
+    pthread_mutex_unlock(&h->lock);
+    return ptr;
+}
+
+/* restore the bound of the locked heap h, giving sb to heap 0 if it is sparse */
+static void _hoard_release(hoard_heap_t *h, sb_t *sb) {
+    if (!SB_SPARSE(sb)) { //look for another, one exists unless headers eat the slack
+        sb = NULL;
+        for (int c = ESIZE / DSIZE; sb == NULL && c <= HOARD_CLASSES; c++) {
+            for (sb = h->bins[c]; sb != NULL && !SB_SPARSE(sb); sb = sb->next)
+                ;
+        }
+        if (sb == NULL) {
+            return;
+        }
+    }
+    hoard_heap_t *g = &hoard_heaps[0];
+    pthread_mutex_lock(&g->lock);
+    _sb_move(h, g, sb, sb->nfree == sb->nobjs? 0 : sb->cls);
+    pthread_mutex_unlock(&g->lock);
+}
+
+/* return a block to its superblock, locking the heap that owns it now */
+static void _hoard_free(void *ptr) {
+    sb_t *sb = SB_OF(ptr);
+    hoard_heap_t *h;
+    for (;;) { //the owner only changes under its own lock
+        h = sb->owner;
+        pthread_mutex_lock(&h->lock);
+        if (h == sb->owner) {
+            break;
+        }
+        pthread_mutex_unlock(&h->lock);
+    }
+    *(void **)ptr = sb->free_list;
+    sb->free_list = ptr;
+    h->used -= sb->cls * DSIZE;
+    if (sb->nfree++ == 0) {
+        _sb_link(h, sb, sb->cls);
+    }
+    if (h == &hoard_heaps[0]) {
+        if (sb->nfree == sb->nobjs) {
+            _sb_unlink(h, sb);
+            _sb_link(h, sb, 0);
+        }
+    } else if (HOARD_SLACK(h)) {
+        _hoard_release(h, sb);
+    }
+    pthread_mutex_unlock(&h->lock);
+}
+
+/* forget the superblocks, they belong to a dead heap */
+static void _hoard_reset(void) {
+    for (int i = 0; i < HOARD_HEAPS; i++) {
+        memset(hoard_heaps[i].bins, 0, sizeof(hoard_heaps[i].bins));
+        hoard_heaps[i].used = hoard_heaps[i].held = 0;
+    }
+}
+
+/* new small blocks come from the superblocks, freed ones always go back */
+static int hoard_on = 1;
+
+#endif
+
+/*
+ * Out of band metadata
+ *      Requests up to META_MAX bytes are served from pages of one class,
+ *      taken from the list allocator META_CHUNK bytes at a time. A page's
+ *      class, free count, list links and slot bitmap live in page_meta, a
+ *      static array apart from the heap, and the blocks carry no header:
+ *      malloc and free only write page_meta, never the payload pages. A
+ *      forked child that inherits a warm heap copies one metadata page
+ *      per 85 payload pages it allocates in or frees to, instead of each
+ *      of those payload pages. Larger blocks keep their in band headers.
+ *      A chunk whose pages all lost their class goes back to the list.
+ */
+#ifdef MM_METAPAGES
+
+typedef struct {
+    unsigned short cls;      /* class + 1, 0 for pages of the list allocator */
+    unsigned short nfree;    /* free slots */
+    unsigned int prev, next; /* page list links, page number + 1 */
+    unsigned int chunk;      /* first page of its chunk + 1 */
+    unsigned int block;      /* on a chunk's first page: offset of its list block */
+    unsigned short used;     /* on a chunk's first page: its pages with a class */
+    unsigned long map[META_PAGE / ESIZE / 64]; /* set bits are free slots */
+} page_meta_t;
+
+static const unsigned short meta_sizes[] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 256,
+    320, 384, 512, 680, 1024, 1360, 2048
+};
+#define META_CLASSES (int)(sizeof(meta_sizes) / sizeof(meta_sizes[0]))
+
+static page_meta_t page_meta[(MAX_HEAP >> META_PAGE_SHIFT) + 1];
+static unsigned int meta_lists[META_CLASSES]; /* pages with free slots */
+static unsigned int meta_free;  /* pages with no class */
+static unsigned int meta_top;   /* pages numbered below are in use */
+static char *meta_base;         /* heap_ptr rounded down to a page */
+static char *chunk_next;        /* next page of the last chunk */
+static int chunk_left;          /* pages left in it */
+static unsigned int chunk_first; /* its first page */
+
+#define PAGE_NO(bp) ((unsigned int)(((char *)(bp) - meta_base) >> META_PAGE_SHIFT))
+#define PAGE_ADDR(n) (meta_base + ((size_t)(n) << META_PAGE_SHIFT))
+
+static int _meta_class(size_t size) {
+    if (size <= 256) {
+        return (size + 15) / 16 - 1;
+    }
+    int c = 16;
+    while (meta_sizes[c] < size) {
+        c++;
+    }
+    return c;
+}
+
+static void _meta_push(unsigned int *list, unsigned int n) {
+    page_meta[n].prev = 0;
+    page_meta[n].next = *list;
+    if (*list != 0) {
+        page_meta[*list - 1].prev = n + 1;
+    }
+    *list = n + 1;
+}
+
+static void _meta_remove(unsigned int *list, unsigned int n) {
+    page_meta_t *m = &page_meta[n];
+    if (m->prev != 0) {
+        page_meta[m->prev - 1].next = m->next;
+    } else {
+        *list = m->next;
+    }
+    if (m->next != 0) {
+        page_meta[m->next - 1].prev = m->prev;
+    }
+}
+
+/* the metadata of the page holding ptr, NULL for list allocator blocks */
+static page_meta_t *_meta_of(void *ptr) {
+    if ((char *)ptr < meta_base || PAGE_NO(ptr) >= meta_top) {
+        return NULL;
+    }
+    page_meta_t *m = &page_meta[PAGE_NO(ptr)];
+    return m->cls != 0? m : NULL;
+}
+
+/* give a page to class c: a classless one, else the next of the chunk */
+static int _meta_page(int c) {
+    unsigned int n;
+    if (meta_free != 0) {
+        n = meta_free - 1;
+        _meta_remove(&meta_free, n);
+    } else {
+        if (chunk_left == 0) {
+            char *bp = _malloc(META_CHUNK + META_PAGE - WSIZE);
+            if (bp == NULL) {
+                return -1;
+            }
+            chunk_next = (char *)(((unsigned long)bp + META_PAGE - 1) & ~(unsigned long)(META_PAGE - 1));
+            chunk_left = META_CHUNK / META_PAGE;
+            chunk_first = PAGE_NO(chunk_next);
+            page_meta[chunk_first].block = bp - meta_base;
+            page_meta[chunk_first].used = 0;
+        }
+        n = PAGE_NO(chunk_next);
+        chunk_next += META_PAGE;
+        chunk_left--;
+        meta_top = MAX(meta_top, n + 1);
+        page_meta[n].chunk = chunk_first + 1;
+    }
+    page_meta_t *m = &page_meta[n];
+    int slots = META_PAGE / meta_sizes[c];
+    page_meta[m->chunk - 1].used++;
+    m->cls = c + 1;
+    m->nfree = slots;
+    memset(m->map, 0, sizeof(m->map));
+    for (int w = 0; w < slots / 64; w++) {
+        m->map[w] = ~0UL;
+    }
+    if (slots % 64 != 0) {
+        m->map[slots / 64] = (1UL << (slots % 64)) - 1;
+    }
+    _meta_push(&meta_lists[c], n);
+    return n;
+}
+
+static void *_meta_malloc(size_t size) {
+    int c = _meta_class(size);
+    if (meta_lists[c] == 0 && _meta_page(c) < 0) {
+        return NULL;
+    }
+    unsigned int n = meta_lists[c] - 1;
+    page_meta_t *m = &page_meta[n];
+    int w = 0;
+    while (m->map[w] == 0) {
+        w++;
+    }
+    int slot = w * 64 + __builtin_ctzl(m->map[w]);
+    m->map[w] &= m->map[w] - 1;
+    if (--m->nfree == 0) {
+        _meta_remove(&meta_lists[c], n);
+    }
+    return PAGE_ADDR(n) + slot * meta_sizes[c];
+}
+
+/* free a block of a class page, return 0 if it is not one */
+static int _meta_free(void *ptr) {
+    page_meta_t *m = _meta_of(ptr);
+    if (m == NULL) {
+        return 0;
+    }
+    int c = m->cls - 1;
+    unsigned int n = PAGE_NO(ptr);
+    int slot = ((char *)ptr - PAGE_ADDR(n)) / meta_sizes[c];
+    m->map[slot / 64] |= 1UL << (slot % 64);
+    if (m->nfree++ == 0) {
+        _meta_push(&meta_lists[c], n);
+    }
+    if (m->nfree == META_PAGE / meta_sizes[c] && (m->prev != 0 || m->next != 0)) {
+        _meta_remove(&meta_lists[c], n); //empty and not the last of its class
+        m->cls = 0;
+        unsigned int first = m->chunk - 1;
+        if (--page_meta[first].used != 0 || (first == chunk_first && chunk_left != 0)) {
+            _meta_push(&meta_free, n);
+            return 1;
+        }
+        for (unsigned int i = first; i < first + META_CHUNK / META_PAGE; i++) {
+            if (i != n) { //the other pages are classless and wait on meta_free
+                _meta_remove(&meta_free, i);
+            }
+        }
+        if (first == chunk_first) {
+            chunk_left = 0;
+        }
+        _free(meta_base + page_meta[first].block);
+    }
+    return 1;
+}
+
+/* forget the pages of the old heap, after mm_init has set heap_ptr */
+static void _meta_reset(void) {
+    memset(page_meta, 0, meta_top * sizeof(page_meta_t));
+    memset(meta_lists, 0, sizeof(meta_lists));
+    meta_free = meta_top = 0;
+    meta_base = (char *)((unsigned long)heap_ptr & ~(unsigned long)(META_PAGE - 1));
+    chunk_left = 0;
+}
+
+#endif
+
+/*
+ * mm_meta_range - Store the bounds of the out of band metadata in use.
+ *      Returns -1 if the build keeps its metadata in band.
+ */
+int mm_meta_range(void **lo, void **hi) {
+#ifdef MM_METAPAGES
+    *lo = page_meta;
+    *hi = &page_meta[meta_top];
+    return 0;
+#else
+    *lo = *hi = NULL;
+    return -1;
+#endif
+}
+
+/*
+ * mm_hoard_enable - Turn the superblock heaps on or off for new blocks,
+ *      blocks already in superblocks are freed to them either way.
+ *      On by default. Returns -1 if the build has no superblock heaps.
+ */
+int mm_hoard_enable(int on) {
+#ifdef MM_HOARD
+    hoard_on = on != 0;
+    return 0;
+#else
+    return on? -1 : 0;
+#endif
+}
+
+/*
+ * mm_percpu_enable - Turn the per cpu caches on or off, flushing them
+ *      when turned off. Call it while no other thread allocates.
+ *      Returns -1 if the build or the kernel has no per cpu caches.
+ */
+int mm_percpu_enable(int on) {
+#if defined(MM_PERCPU) && defined(__x86_64__)
+    if (__rseq_size == 0) {
+        percpu_on = 0;
+        return on? -1 : 0;
+    }
+    if (!on && percpu_on > 0) {
+        _cpu_flush();
+    }
+    percpu_on = on != 0;
+    return 0;
+#else
+    return on? -1 : 0;
+#endif
+}
+
+/*
+ * Lock-free class stacks
+ *      Freed small blocks are pushed on a Treiber stack per class and
+ *      popped by the next request of that class, without the heap lock.
+ *      A link is the 32-bit offset of the next block from heap_ptr, the
+ *      encoding of the free list, kept in the first payload word. The
+ *      head packs the offset of the top block with a 32-bit ABA tag into
+ *      one 64-bit word and is swapped with a single CAS. A pop may read
+ *      the link of a block another thread has just taken; the heap stays
+ *      mapped, so the read is harmless, and the bumped tag fails the CAS.
+ *      No double-width CAS and no hazard pointers are needed. Stacked
+ *      blocks stay allocated in the list. The stacks are on unless turned
+ *      off; built next to MM_PERCPU they only see what the cpus pass on.
+ */
+#ifdef MM_LFSTACKS
+
+typedef struct {
+    volatile unsigned long head; /* tag << 32 | offset of the top block, 0 if empty */
+    volatile long count;         /* blocks stacked, approximate */
+} __attribute__((aligned(64))) lf_stack_t;
+
+static lf_stack_t lf_stacks[LF_CLASSES + 1];
+static volatile int lf_on = 1;
+
+#define LF_PACK(tag, off) (((unsigned long)(tag) << 32) | (off))
+#define LF_TAG(head) ((unsigned int)((head) >> 32))
+#define LF_OFFSET(head) ((unsigned int)(head))
+
+/* take a stacked block for a request, NULL if its class has none */
+static void *_lf_pop(size_t size) {
+    size_t asize = ADJUST_SIZE(size);
+    if (asize > LF_CLASSES * DSIZE) {
+        return NULL;
+    }
+    lf_stack_t *st = &lf_stacks[asize / DSIZE];
+    unsigned long head = __atomic_load_n(&st->head, __ATOMIC_ACQUIRE), next;
+    do {
+        if (LF_OFFSET(head) == 0) {
+            return NULL;
+        }
+        unsigned int link = __atomic_load_n((unsigned int *)(heap_ptr + LF_OFFSET(head)), __ATOMIC_RELAXED);
+        next = LF_PACK(LF_TAG(head) + 1, link);
+    } while (!__atomic_compare_exchange_n(&st->head, &head, next, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    __atomic_fetch_sub(&st->count, 1, __ATOMIC_RELAXED);
+    return heap_ptr + LF_OFFSET(head);
+}
+
+/* stack a freed block, return 0 if it must go to the heap */
+static int _lf_push(void *ptr) {
+    size_t size = GET_SIZE(GET_HEADER(ptr));
+    if (!lf_on || size > LF_CLASSES * DSIZE || GET_TAGGED(GET_HEADER(ptr))) {
+        return 0;
+    }
+    lf_stack_t *st = &lf_stacks[size / DSIZE];
+    if (st->count >= LF_DEPTH) {
+        return 0;
+    }
+    __atomic_fetch_add(&st->count, 1, __ATOMIC_RELAXED);
+    unsigned int off = (char *)ptr - heap_ptr;
+    unsigned long head = __atomic_load_n(&st->head, __ATOMIC_RELAXED), next;
+    do {
+        __atomic_store_n((unsigned int *)ptr, LF_OFFSET(head), __ATOMIC_RELAXED);
+        next = LF_PACK(LF_TAG(head) + 1, off);
+    } while (!__atomic_compare_exchange_n(&st->head, &head, next, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/* forget the stacked blocks, they belong to a dead heap */
+static void _lf_reset(void) {
+    memset(lf_stacks, 0, sizeof(lf_stacks));
+}
+
+/* give every stacked block back, no other thread may be allocating */
+static void _lf_flush(void) {
+    LOCK();
+    for (int c = 0; c <= LF_CLASSES; c++) {
+        unsigned int off = LF_OFFSET(lf_stacks[c].head);
+        while (off != 0) {
+            char *bp = heap_ptr + off;
+            off = READ(bp);
+            _free(bp);
+        }
+        lf_stacks[c].head = 0;
+        lf_stacks[c].count = 0;
+    }
+    UNLOCK();
+}
+
+#endif
+
+/*
+ * mm_lfstack_enable - Turn the lock-free class stacks on or off,
+ *      flushing them when turned off. Call it while no other thread
+ *      allocates. Returns -1 if the build has no class stacks.
+ */
+int mm_lfstack_enable(int on) {
+#ifdef MM_LFSTACKS
+    if (!on && lf_on) {
+        lf_on = 0;
+        _lf_flush();
+    }
+    lf_on = on != 0;
+    return 0;
+#else
+    return on? -1 : 0;
+#endif
+}
+
+/*
+ * Inline caches
+ *      The slow paths of mm_inline.h: a miss fills the class with
+ *      MM_TC_BATCH blocks, a full class drains MM_TC_BATCH of them, both
+ *      under one heap lock. Cached blocks stay allocated in the list.
+ *      Builds whose small blocks have no header leave the cache off.
+ */
+__thread mm_tcache_t mm_tcache;
+static pthread_key_t tc_key;
+static pthread_once_t tc_once = PTHREAD_ONCE_INIT;
+
+/* give a thread's cached blocks back when it exits */
+static void _tc_thread_exit(void *arg) {
+    mm_tcache_t *tc = arg;
+    if (tc->on && tc->gen == mm_heap_gen) {
+        LOCK();
+        for (int c = 0; c <= MM_TC_CLASSES; c++) {
+            while (tc->count[c] > 0) {
+                _free(tc->slots[c][--tc->count[c]]);
+            }
+        }
+        UNLOCK();
+    }
+    tc->on = 0;
+}
+
+static void _tc_key_init(void) {
+    pthread_key_create(&tc_key, _tc_thread_exit);
+}
+
+/* the calling thread's cache, emptied if it belongs to an older heap */
+static mm_tcache_t *_tc_sync(void) {
+    mm_tcache_t *tc = &mm_tcache;
+    if (tc->gen != mm_heap_gen) {
+        pthread_once(&tc_once, _tc_key_init);
+        pthread_setspecific(tc_key, tc);
+        memset(tc->count, 0, sizeof(tc->count));
+        tc->gen = mm_heap_gen;
+#if defined(MM_HOARD) || defined(MM_METAPAGES)
+        tc->on = 0;
+#else
+        tc->on = 1;
+#endif
+    }
+    return tc;
+}
+
+/*
+ * mm_malloc_slow - Refill the class of the request and take a block,
+ *      or allocate it the usual way if it cannot be cached.
+ */
+void *mm_malloc_slow(size_t size) {
+    mm_tcache_t *tc = _tc_sync();
+    size_t c = MM_TC_CLASS(size);
+    if (!tc->on || size == 0 || c > MM_TC_CLASSES) {
+        return malloc(size);
+    }
+    LOCK();
+    while (tc->count[c] < MM_TC_BATCH) {
+        void *ptr = _malloc(c * DSIZE - WSIZE);
+        if (ptr == NULL) {
+            break;
+        }
+        tc->slots[c][tc->count[c]++] = ptr;
+    }
+    UNLOCK();
+    return tc->count[c] != 0? tc->slots[c][--tc->count[c]] : NULL;
+}
+
+/*
+ * mm_free_slow - Drain the full class of the block and cache it, or
+ *      free it the usual way if it cannot be cached.
+ */
+void mm_free_slow(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    mm_tcache_t *tc = _tc_sync();
+    if (!tc->on || (READ(GET_HEADER(ptr)) & 0x5) != 0x1 ||
+            GET_SIZE(GET_HEADER(ptr)) > MM_TC_CLASSES * DSIZE) {
+        free(ptr);
+        return;
+    }
+    size_t c = GET_SIZE(GET_HEADER(ptr)) / DSIZE;
+    if (tc->count[c] == MM_TC_DEPTH) {
+        LOCK();
+        while (tc->count[c] > MM_TC_DEPTH - MM_TC_BATCH) {
+            _free(tc->slots[c][--tc->count[c]]);
+        }
+        UNLOCK();
+    }
+    tc->slots[c][tc->count[c]++] = ptr;
+}
+
+/*
+ * malloc - Allocate a block under the heap lock.
+ *      With the worker running, try its stocks first. Built with
+ *      -DMM_HOARD, small blocks come from the superblock heaps, with
+ *      -DMM_METAPAGES from the class pages.
+ */
+void *malloc(size_t size) {
+    if (bg_queue && size != 0) {
+        void *ptr = _stock_pop(size);
+        if (ptr != NULL) {
+            return ptr;
+        }
+    }
+#ifdef MM_HOARD
+    if (hoard_on && size != 0 && ADJUST_SIZE(size) <= HOARD_CLASSES * DSIZE) {
+        return _hoard_malloc(size);
+    }
+#endif
+#if defined(MM_PERCPU) && defined(__x86_64__)
+    if (size != 0) {
+        void *ptr = _cpu_malloc(size);
+        if (ptr != NULL) {
+            return ptr;
+        }
+    }
+#endif
+#ifdef MM_LFSTACKS
+    if (size != 0) {
+        void *ptr = _lf_pop(size);
+        if (ptr != NULL) {
+            return ptr;
+        }
+    }
+#endif
+    LOCK();
+    SET_GROUP(CALLSITE());
+#ifdef MM_METAPAGES
+    void *ptr = size != 0 && size <= META_MAX? _meta_malloc(size) : _malloc(size);
+#else
+    void *ptr = _malloc(size);
+#endif
+    RESET_GROUP();
+    UNLOCK();
+    return ptr;
+}
+
+/*
+ * free - Release a block under the heap lock.
+ *      With the worker running, leave the merging to it.
+ */
+void free(void *ptr) {
+#ifdef MM_HOARD
+    if (ptr != NULL && HOARD_OBJ(ptr)) {
+        _hoard_free(ptr);
+        return;
+    }
+#endif
+    if (bg_queue && ptr != NULL) {
+        _queue_push(ptr);
+        if (!bg_queue) { //mm_worker_stop may have drained already
+            _worker_drain();
+        }
+        return;
+    }
+#if defined(MM_PERCPU) && defined(__x86_64__)
+    if (ptr != NULL && _cpu_free(ptr)) {
+        return;
+    }
+#endif
+#ifdef MM_LFSTACKS
+    if (ptr != NULL && _lf_push(ptr)) {
+        return;
+    }
+#endif
+    LOCK();
+    _free(ptr);
+    UNLOCK();
+}
+
+/*
+ * realloc - Change the size of the block by mallocing a new block,
+ *      copying its data, and freeing the old block.
+ */
+void *realloc(void *oldptr, size_t size) {
+    if (size == 0) {
+        free(oldptr);
+        return 0;
+    }
+    if(oldptr == NULL) {
+        return malloc(size);
+    }
+#ifdef MM_HOARD
+    if (HOARD_OBJ(oldptr)) { //the class does not change while the block lives
+        size_t oldsize = SB_OF(oldptr)->cls * DSIZE;
+        void *newptr = malloc(size);
+        if (newptr != NULL) {
+            memcpy(newptr, oldptr, MIN(oldsize - WSIZE, size));
+            COST(bytes, MIN(oldsize - WSIZE, size));
+            free(oldptr);
+        }
+        return newptr;
+    }
+#endif
+#ifdef MM_METAPAGES
+    page_meta_t *m = _meta_of(oldptr);
+    if (m != NULL) { //no header, the class gives the size
+        size_t oldsize = meta_sizes[m->cls - 1];
+        void *newptr = malloc(size);
+        if (newptr != NULL) {
+            memcpy(newptr, oldptr, MIN(oldsize, size));
+            COST(bytes, MIN(oldsize, size));
+            free(oldptr);
+        }
+        return newptr;
+    }
+#endif
+    LOCK();
+    SET_GROUP(CALLSITE());
+    size_t tagged = GET_TAGGED(GET_HEADER(oldptr));
+    unsigned int tag = tagged? READ(GET_FOOTER(oldptr)) : 0;
+    void *newptr = _malloc(tagged? size + WSIZE : size);
+    RESET_GROUP();
+    size_t oldsize = GET_SIZE(GET_HEADER(oldptr));
+    size_t newsize = GET_SIZE(GET_HEADER(newptr));
+    size_t cpysize = MIN(oldsize, newsize);
+    memcpy(newptr, oldptr, cpysize - WSIZE);
+    COST(bytes, cpysize - WSIZE);
+    if (tagged) {
+        _tag_block(newptr, tag);
+    }
+    _free(oldptr);
+    UNLOCK();
+    return newptr;
+}
+
+/*
+ * calloc - Allocate the block and set it to zero.
+ */
+void *calloc (size_t nmemb, size_t size) {
+    size_t bytes = nmemb * size;
+    void *newptr = malloc(bytes);
+    memset(newptr, 0, bytes);
+    COST(bytes, bytes);
+    return newptr;
+}
+
+/*
+ * mm_malloc_tagged - Allocate a block charged to tag.
+ *      The tag sits in the block's footer, which allocated blocks do not
+ *      otherwise need, so one extra word is reserved behind the payload.
+ */
+void *mm_malloc_tagged(unsigned int tag, size_t size) {
+    if (tag >= MM_MAX_TAGS || size == 0) {
+        return NULL;
+    }
+    LOCK();
+    SET_GROUP(CALLSITE());
+    void *ptr = _malloc(size + WSIZE);
+    RESET_GROUP();
+    if (ptr != NULL) {
+        _tag_block(ptr, tag);
+    }
+    UNLOCK();
+    return ptr;
+}
+
+/*
+ * mm_tag_stats - Sum the counters of tag over all threads.
+ *      Exact once the heap is quiescent, each counter is read atomically.
+ */
+int mm_tag_stats(unsigned int tag, mm_tag_stats_t *stats) {
+    if (tag >= MM_MAX_TAGS || stats == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&tag_lock);
+    unsigned long gen = mm_heap_gen;
+    int live = tag_retired.gen == gen;
+    stats->live_bytes = live? tag_retired.live_bytes[tag] : 0;
+    stats->allocs = live? tag_retired.allocs[tag] : 0;
+    stats->frees = live? tag_retired.frees[tag] : 0;
+    for (int i = 0; i < MAX_THREADS; i++) {
+        tag_cache_t *tc = &tag_caches[i];
+        if (tc->used && tc->gen == gen) {
+            stats->live_bytes += __atomic_load_n(&tc->live_bytes[tag], __ATOMIC_RELAXED);
+            stats->allocs += __atomic_load_n(&tc->allocs[tag], __ATOMIC_RELAXED);
+            stats->frees += __atomic_load_n(&tc->frees[tag], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&tag_lock);
+    return 0;
+}
+
+/*
+ * mm_malloc_ref32 - Allocate a block and return it as a 32-bit reference.
+ *      The heap never exceeds MAX_HEAP, so every offset fits in 32 bits.
+ */
+mm_ref32_t mm_malloc_ref32(size_t size) {
+    return mm_ptr_ref32(malloc(size));
+}
+
+/*
+ * mm_free_ref32 - Free the block behind a 32-bit reference.
+ */
+void mm_free_ref32(mm_ref32_t ref) {
+    free(mm_ref32_ptr(ref));
+}
+
+/*
+ * Epoch based reclamation
+ *      Readers bracket their accesses with mm_epoch_enter/mm_epoch_exit,
+ *      writers hand unlinked blocks to mm_retire. A block retired in
+ *      epoch e is released once the global epoch reaches e + 2, by then
+ *      every reader that could still see it has left its section.
+ */
+
+/* one slot per registered thread */
+typedef struct {
+    volatile unsigned long epoch; /* global epoch seen at enter */
+    volatile int active;          /* inside a read section */
+    volatile int used;            /* owned by a live thread */
+} epoch_slot_t;
+
+/* retired blocks of one epoch, chunks are taken from the heap itself */
+typedef struct limbo_chunk {
+    struct limbo_chunk *next;
+    unsigned long epoch; /* global epoch its blocks were retired in */
+    long cnt;
+    void *ptrs[RETIRE_BATCH + 1]; //one extra for the chunk itself
+} limbo_chunk_t;
+
+static epoch_slot_t epoch_slots[MAX_THREADS];
+static volatile unsigned long global_epoch;
+
+/*
+ * threads beyond MAX_THREADS share one slot, its readers are counted
+ * under the epoch they entered in
+ */
+static epoch_slot_t epoch_overflow;
+static volatile long overflow_readers[NEPOCHS];
+
+static __thread epoch_slot_t *my_slot;
+static __thread int my_depth;
+static __thread unsigned long my_enter_epoch; //of a reader on the shared slot
+static __thread unsigned long my_gen;
+static __thread unsigned long limbo_epoch[NEPOCHS];
+static __thread limbo_chunk_t *limbo[NEPOCHS];
+
+/* limbo chunks of exited threads, released by whoever reclaims next */
+static limbo_chunk_t *volatile orphans;
+static unsigned long orphan_gen;
+static pthread_mutex_t orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+
+/* release the blocks of a chunk, then the chunk */
+static void _chunk_release(limbo_chunk_t *chunk) {
+    chunk->ptrs[chunk->cnt++] = chunk;
+    _free_batch(chunk->ptrs, chunk->cnt);
+}
+
+/* release the orphaned chunks that are two epochs behind e */
+static void _orphan_reclaim(unsigned long e) {
+    if (orphans == NULL) {
+        return;
+    }
+    limbo_chunk_t *ready = NULL;
+    pthread_mutex_lock(&orphan_lock);
+    if (orphan_gen != mm_heap_gen) { //the heap was reset, the chunks are gone
+        orphans = NULL;
+    }
+    for (limbo_chunk_t *volatile *pp = &orphans; *pp != NULL; ) {
+        limbo_chunk_t *chunk = *pp;
+        if (chunk->epoch + 2 <= e) {
+            *pp = chunk->next;
+            chunk->next = ready;
+            ready = chunk;
+        } else {
+            pp = &chunk->next;
+        }
+    }
+    pthread_mutex_unlock(&orphan_lock);
+    while (ready != NULL) {
+        limbo_chunk_t *next = ready->next;
+        _chunk_release(ready);
+        ready = next;
+    }
+}
+
+/* hand the limbo lists of an exiting thread over to the orphans */
+static void _orphan_adopt(void) {
+    pthread_mutex_lock(&orphan_lock);
+    if (orphan_gen != mm_heap_gen) {
+        orphans = NULL;
+        orphan_gen = mm_heap_gen;
+    }
+    for (int k = 0; k < NEPOCHS; k++) {
+        while (limbo[k] != NULL) {
+            limbo_chunk_t *chunk = limbo[k];
+            limbo[k] = chunk->next;
+            chunk->next = orphans;
+            orphans = chunk;
+        }
+    }
+    pthread_mutex_unlock(&orphan_lock);
+}
+
+/* release every block of an epoch's limbo list, then the chunks */
+static void _limbo_release(int k) {
+    limbo_chunk_t *chunk = limbo[k];
+    limbo[k] = NULL;
+    while (chunk != NULL) {
+        limbo_chunk_t *next = chunk->next;
+        _chunk_release(chunk);
+        chunk = next;
+    }
+}
+
+/* release the limbo lists, own and orphaned, that are two epochs behind e */
+static void _limbo_reclaim(unsigned long e) {
+    _orphan_reclaim(e);
+    if (my_gen != mm_heap_gen) { //the heap was reset, the lists are gone
+        for (int k = 0; k < NEPOCHS; k++) {
+            limbo[k] = NULL;
+        }
+        my_gen = mm_heap_gen;
+        return;
+    }
+    for (int k = 0; k < NEPOCHS; k++) {
+        if (limbo[k] != NULL && limbo_epoch[k] + 2 <= e) {
+            _limbo_release(k);
+        }
+    }
+}
+
+/* move the global epoch forward if every active reader has seen it */
+static int _epoch_try_advance(void) {
+    unsigned long e = global_epoch;
+    __sync_synchronize();
+    for (int i = 0; i < MAX_THREADS; i++) {
+        epoch_slot_t *slot = &epoch_slots[i];
+        if (slot->used && slot->active && slot->epoch != e) {
+            return 0;
+        }
+    }
+    for (int k = 0; k < NEPOCHS; k++) {
+        if (k != (int)(e % NEPOCHS) && overflow_readers[k] != 0) {
+            return 0;
+        }
+    }
+    return __sync_bool_compare_and_swap(&global_epoch, e, e + 1);
+}
+
+/*
+ * a thread leaves: release what is old enough, leave the rest to the
+ * orphans instead of waiting for slow readers, and give its slot back
+ */
+static void _epoch_thread_exit(void *arg) {
+    epoch_slot_t *slot = arg;
+    if (my_depth > 0) {
+        my_depth = 1;
+        mm_epoch_exit();
+    }
+    _epoch_try_advance();
+    _limbo_reclaim(global_epoch);
+    _orphan_adopt();
+    if (slot != &epoch_overflow) {
+        __atomic_store_n(&slot->used, 0, __ATOMIC_RELEASE);
+    }
+    my_slot = NULL;
+}
+
+static void _epoch_key_init(void) {
+    pthread_key_create(&epoch_key, _epoch_thread_exit);
+}
+
+/* find the calling thread's slot, registering it on first use */
+static epoch_slot_t *_epoch_slot(void) {
+    if (my_slot != NULL) {
+        return my_slot;
+    }
+    pthread_once(&epoch_once, _epoch_key_init);
+    my_slot = &epoch_overflow; //too many threads, share the overflow slot
+    for (int i = 0; i < MAX_THREADS; i++) {
+        epoch_slot_t *slot = &epoch_slots[i];
+        if (!slot->used && __sync_bool_compare_and_swap(&slot->used, 0, 1)) {
+            my_slot = slot;
+            break;
+        }
+    }
+    my_gen = mm_heap_gen;
+    pthread_setspecific(epoch_key, my_slot);
+    return my_slot;
+}
+
+/*
+ * mm_epoch_enter - Start a read section, blocks retired from now on
+ *      stay valid until the matching mm_epoch_exit. Sections may nest.
+ */
+void mm_epoch_enter(void) {
+    epoch_slot_t *slot = _epoch_slot();
+    if (my_depth++ > 0) {
+        return;
+    }
+    if (slot == &epoch_overflow) { //count in, then make sure the epoch did not move
+        for (;;) {
+            unsigned long e = global_epoch;
+            __sync_fetch_and_add(&overflow_readers[e % NEPOCHS], 1);
+            if (global_epoch == e) {
+                my_enter_epoch = e;
+                return;
+            }
+            __sync_fetch_and_sub(&overflow_readers[e % NEPOCHS], 1);
+        }
+    }
+    slot->epoch = global_epoch;
+    __atomic_store_n(&slot->active, 1, __ATOMIC_RELEASE);
+    __sync_synchronize();
+}
+
+/*
+ * mm_epoch_exit - End a read section.
+ */
+void mm_epoch_exit(void) {
+    if (--my_depth > 0) {
+        return;
+    }
+    if (my_slot == &epoch_overflow) {
+        __sync_fetch_and_sub(&overflow_readers[my_enter_epoch % NEPOCHS], 1);
+        return;
+    }
+    __atomic_store_n(&my_slot->active, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * mm_retire - Free ptr once no reader can still hold it.
+ *      The block is queued on the caller's list for the current epoch,
+ *      each full batch tries to advance the epoch and release old lists.
+ */
+void mm_retire(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    _epoch_slot();
+    __sync_synchronize(); //the unlink must be visible before we read the epoch
+    unsigned long e = global_epoch;
+    _limbo_reclaim(e);
+    int k = e % NEPOCHS;
+    limbo_chunk_t *chunk = limbo[k];
+    if (chunk == NULL || chunk->cnt == RETIRE_BATCH) {
+        if (chunk != NULL && _epoch_try_advance()) {
+            _limbo_reclaim(global_epoch);
+        }
+        limbo_chunk_t *fresh = malloc(sizeof(limbo_chunk_t));
+        if (fresh == NULL) { //leaking is the only safe choice here
+            return;
+        }
+        fresh->next = limbo[k];
+        fresh->cnt = 0;
+        fresh->epoch = e;
+        limbo[k] = chunk = fresh;
+        limbo_epoch[k] = e;
+    }
+    chunk->ptrs[chunk->cnt++] = ptr;
+}
+
+/*
+ * mm_retire_flush - Wait until every block retired by this thread, or
+ *      left behind by an exited one, is freed.
+ *      Must not be called inside a read section.
+ */
+void mm_retire_flush(void) {
+    _epoch_slot();
+    for (;;) {
+        _limbo_reclaim(global_epoch);
+        int pending = orphans != NULL;
+        for (int k = 0; k < NEPOCHS; k++) {
+            pending |= limbo[k] != NULL;
+        }
+        if (!pending) {
+            return;
+        }
+        if (!_epoch_try_advance()) {
+            sched_yield();
+        }
+    }
+}
+
+/*
+ * mm_cost_get - Copy the work counted since the last reset to cost,
+ *      if not NULL. Returns -1 if the build does not count.
+ */
+int mm_cost_get(mm_cost_t *cost_out) {
+#ifdef MM_COST
+    if (cost_out != NULL) {
+        *cost_out = cost;
+    }
+    return 0;
+#else
+    (void)cost_out;
+    return -1;
+#endif
+}
+
+/*
+ * mm_cost_reset - Zero the work counters.
+ */
+void mm_cost_reset(void) {
+#ifdef MM_COST
+    memset(&cost, 0, sizeof(cost));
+#endif
 }
 
 void mm_checkheap(int verbose) {
@@ -1,5 +1,12 @@
+#ifndef __MM_H_
+#define __MM_H_
+
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #ifdef DRIVER
 
 /* declare functions for driver tests */
@@ -20,6 +27,77 @@ extern void *calloc (size_t nmemb, size_t size);
 
 extern int mm_init(void);
 
+/* epoch based reclamation for lock-free structures, see mm.c */
+extern void mm_epoch_enter(void);
+extern void mm_epoch_exit(void);
+extern void mm_retire(void *ptr);
+extern void mm_retire_flush(void);
+
+/* tagged allocations with exact per tag accounting */
+#define MM_MAX_TAGS 64
+
+typedef struct {
+    long live_bytes; /* heap bytes held by live blocks of the tag */
+    long allocs;     /* number of tagged allocations */
+    long frees;      /* number of tagged blocks released */
+} mm_tag_stats_t;
+
+extern void *mm_malloc_tagged(unsigned int tag, size_t size);
+extern int mm_tag_stats(unsigned int tag, mm_tag_stats_t *stats);
+
+/*
+ * 32-bit heap relative references, the same encoding as the free list
+ * links: an offset from the first block, 0 is the null reference
+ */
+typedef unsigned int mm_ref32_t;
+
+extern char *mm_ref32_base;
+
+extern mm_ref32_t mm_malloc_ref32(size_t size);
+extern void mm_free_ref32(mm_ref32_t ref);
+
+static inline void *mm_ref32_ptr(mm_ref32_t ref) {
+    return ref == 0? NULL : mm_ref32_base + ref;
+}
+
+static inline mm_ref32_t mm_ptr_ref32(const void *ptr) {
+    return ptr == NULL? 0 : (mm_ref32_t)((const char *)ptr - mm_ref32_base);
+}
+
+/* background worker that merges frees and keeps small blocks ready */
+extern int mm_worker_start(void);
+extern void mm_worker_stop(void);
+
+/* out of band metadata of small blocks, built with -DMM_METAPAGES */
+extern int mm_meta_range(void **lo, void **hi);
+
+/* superblock heaps of small blocks, built with -DMM_HOARD */
+extern int mm_hoard_enable(int on);
+
+/* per cpu small block caches, built with -DMM_PERCPU */
+extern int mm_percpu_enable(int on);
+
+/* lock-free class stacks of freed small blocks, built with -DMM_LFSTACKS */
+extern int mm_lfstack_enable(int on);
+
+/* abstract work of the allocator, counted by a build with -DMM_COST */
+typedef struct {
+    unsigned long nodes;   /* free list nodes visited by the fit searches */
+    unsigned long reads;   /* header, footer and link words read */
+    unsigned long writes;  /* header, footer and link words written */
+    unsigned long bytes;   /* payload bytes copied or zeroed */
+    unsigned long extends; /* heap extensions */
+} mm_cost_t;
+
+extern int mm_cost_get(mm_cost_t *cost);
+extern void mm_cost_reset(void);
+
 /* This is largely for debugging.  You can do what you want with the
    verbose flag; we don't care. */
 extern void mm_checkheap(int verbose);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __MM_H_ */
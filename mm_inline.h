@@ -0,0 +1,70 @@
+/*
+ * mm_inline.h - inline fast path for small allocations
+ *
+ * mm_inline_malloc and mm_inline_free pop and push blocks on a per
+ * thread cache of size classes, inlined into the caller. Only a miss,
+ * an overflow or a block that cannot be cached costs a call into mm.c,
+ * which refills or drains the cache MM_TC_BATCH blocks at a time under
+ * one heap lock. The cache is dropped when mm_init starts a new heap,
+ * and given back to the heap when its thread exits.
+ */
+#ifndef __MM_INLINE_H_
+#define __MM_INLINE_H_
+
+#include <stddef.h>
+
+#include "mm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MM_TC_CLASSES 16 /* cached block sizes: 16 .. MM_TC_CLASSES * 8 */
+#define MM_TC_DEPTH 32   /* blocks per class */
+#define MM_TC_BATCH 16   /* blocks moved per refill or drain */
+
+/* class of a request: its block size in double words, header included */
+#define MM_TC_CLASS(size) ((size) < 12? 2 : ((size) + 4 + 7) >> 3)
+
+typedef struct {
+    int on;            /* set by mm.c if the blocks of the build have headers */
+    unsigned long gen; /* heap the cached blocks belong to */
+    unsigned int count[MM_TC_CLASSES + 1];
+    void *slots[MM_TC_CLASSES + 1][MM_TC_DEPTH];
+} mm_tcache_t;
+
+extern __thread mm_tcache_t mm_tcache;
+extern volatile unsigned long mm_heap_gen; /* bumped by mm_init */
+
+extern void *mm_malloc_slow(size_t size);
+extern void mm_free_slow(void *ptr);
+
+static inline void *mm_inline_malloc(size_t size) {
+    mm_tcache_t *tc = &mm_tcache;
+    size_t c = MM_TC_CLASS(size);
+    if (__builtin_expect(size != 0 && c <= MM_TC_CLASSES && tc->count[c] != 0 &&
+                tc->gen == mm_heap_gen, 1)) {
+        return tc->slots[c][--tc->count[c]];
+    }
+    return mm_malloc_slow(size);
+}
+
+/* the word before the payload is the header: block size | 0x4 tagged | 0x1 allocated */
+static inline void mm_inline_free(void *ptr) {
+    mm_tcache_t *tc = &mm_tcache;
+    if (__builtin_expect(ptr != NULL && tc->on && tc->gen == mm_heap_gen, 1)) {
+        unsigned int header = ((unsigned int *)ptr)[-1];
+        size_t c = header >> 3;
+        if ((header & 0x5) == 0x1 && c <= MM_TC_CLASSES && tc->count[c] < MM_TC_DEPTH) {
+            tc->slots[c][tc->count[c]++] = ptr;
+            return;
+        }
+    }
+    mm_free_slow(ptr);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __MM_INLINE_H_ */
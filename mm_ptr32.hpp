@@ -0,0 +1,69 @@
+/*
+ * mm_ptr32.hpp - typed 32-bit heap references on top of mm_ref32
+ *
+ * A ptr32<T> is half the size of a T *, so pointer heavy nodes (trees,
+ * lists, graphs) pack twice as many links per cache line. Dereferencing
+ * costs one add to mm_ref32_base. Only objects allocated from the mm
+ * heap can be referenced, and references die with the next mm_init.
+ */
+#ifndef __MM_PTR32_HPP_
+#define __MM_PTR32_HPP_
+
+#include <cstddef>
+#include <new>
+#include <utility>
+
+#include "mm.h"
+
+namespace mm {
+
+template <typename T>
+class ptr32 {
+public:
+    ptr32() : ref_(0) {}
+    ptr32(std::nullptr_t) : ref_(0) {}
+    explicit ptr32(T *ptr) : ref_(mm_ptr_ref32(ptr)) {}
+
+    static ptr32 from_ref(mm_ref32_t ref) {
+        ptr32 p;
+        p.ref_ = ref;
+        return p;
+    }
+
+    T *get() const { return static_cast<T *>(mm_ref32_ptr(ref_)); }
+    mm_ref32_t ref() const { return ref_; }
+
+    T &operator*() const { return *get(); }
+    T *operator->() const { return get(); }
+    explicit operator bool() const { return ref_ != 0; }
+
+    bool operator==(const ptr32 &other) const { return ref_ == other.ref_; }
+    bool operator!=(const ptr32 &other) const { return ref_ != other.ref_; }
+
+private:
+    mm_ref32_t ref_;
+};
+
+/* allocate and construct a T on the mm heap */
+template <typename T, typename... Args>
+ptr32<T> make_ptr32(Args &&...args) {
+    mm_ref32_t ref = mm_malloc_ref32(sizeof(T));
+    if (ref == 0) {
+        throw std::bad_alloc();
+    }
+    new (mm_ref32_ptr(ref)) T(std::forward<Args>(args)...);
+    return ptr32<T>::from_ref(ref);
+}
+
+/* destroy and free an object made by make_ptr32 */
+template <typename T>
+void destroy(ptr32<T> p) {
+    if (p) {
+        p->~T();
+        mm_free_ref32(p.ref());
+    }
+}
+
+} // namespace mm
+
+#endif /* __MM_PTR32_HPP_ */
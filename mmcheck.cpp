@@ -0,0 +1,469 @@
+/*
+ * mmcheck.cpp - Checks for the mm.c interfaces the driver does not reach
+ *
+ * The traces only call malloc, free and realloc. This program covers
+ * the rest, each section on a fresh heap:
+ *   ref32  - mm_malloc_ref32/mm_free_ref32 and the mm::ptr32 wrapper
+ *   tags   - mm_malloc_tagged/mm_tag_stats, alone and from several threads
+ *   retire - mm_epoch_enter/exit, mm_retire and mm_retire_flush
+ *   worker - malloc, realloc and free while the background worker runs
+ *   percpu - the same through the per cpu caches, then mm_percpu_enable(0)
+ *   hoard  - the same through the superblock heaps, in a -DMM_HOARD build
+ *   meta   - the same with out of band metadata, in a -DMM_METAPAGES build
+ *   stacks - the same through the class stacks, per cpu caches off
+ *   inline - the same through mm_inline_malloc and mm_inline_free
+ * Runs the sections named on the command line, all of them by default.
+ * Prints one line per section and exits nonzero on the first failure.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mm_inline.h"
+#include "mm_ptr32.hpp"
+
+extern "C" {
+#include "memlib.h"
+}
+
+#define NTHREADS   4       /* threads in the tag and retire sections */
+#define NNODES     1000    /* nodes in the ptr32 tree */
+#define NROUNDS    20000   /* operations per thread */
+#define NSHARED    64      /* slots the retire threads swap blocks into */
+#define RETIRE_TAG 7       /* tag of the blocks handed to mm_retire */
+#define ORPHAN_TAG 8       /* tag of the blocks an exiting thread retires */
+#define NSMOKE     2000    /* blocks per smoke check */
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "mmcheck: %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(1); \
+	} \
+} while (0)
+
+static void fresh_heap(void)
+{
+	mem_reset_brk();
+	CHECK(mm_init() >= 0);
+}
+
+/*
+ * ref32
+ */
+struct node {
+	long key;
+	mm::ptr32<node> left, right;
+	node(long k) : key(k) {}
+};
+
+static mm::ptr32<node> insert(mm::ptr32<node> root, long key)
+{
+	if (!root)
+		return mm::make_ptr32<node>(key);
+	if (key < root->key)
+		root->left = insert(root->left, key);
+	else
+		root->right = insert(root->right, key);
+	return root;
+}
+
+static long sum(mm::ptr32<node> root)
+{
+	return root? root->key + sum(root->left) + sum(root->right) : 0;
+}
+
+static void destroy_tree(mm::ptr32<node> root)
+{
+	if (root) {
+		destroy_tree(root->left);
+		destroy_tree(root->right);
+		mm::destroy(root);
+	}
+}
+
+static void check_ref32(void)
+{
+	fresh_heap();
+
+	CHECK(mm_ref32_ptr(0) == NULL);
+	CHECK(mm_ptr_ref32(NULL) == 0);
+
+	mm_ref32_t ref = mm_malloc_ref32(100);
+	CHECK(ref != 0);
+	char *p = (char *)mm_ref32_ptr(ref);
+	CHECK(p >= (char *)mem_heap_lo() && p < (char *)mem_heap_hi());
+	CHECK(mm_ptr_ref32(p) == ref);
+	memset(p, 0xab, 100);
+	mm_free_ref32(ref);
+	mm_free_ref32(0);
+
+	CHECK(sizeof(mm::ptr32<node>) == 4);
+	CHECK(sizeof(node) == sizeof(long) + 8);
+
+	mm::ptr32<node> root;
+	long expect = 0;
+	for (long i = 0; i < NNODES; i++) {
+		long key = (i * 7919) % NNODES;
+		root = insert(root, key);
+		expect += key;
+	}
+	CHECK(root && root != nullptr);
+	CHECK(mm::ptr32<node>(root.get()) == root);
+	CHECK(sum(root) == expect);
+	destroy_tree(root);
+
+	printf("ref32: ok\n");
+}
+
+/*
+ * tags
+ */
+static void *tag_thread(void *arg)
+{
+	unsigned int tag = (unsigned int)(long)arg;
+	void *keep = NULL;
+
+	for (int i = 0; i < NROUNDS; i++) {
+		void *p = mm_malloc_tagged(tag, 1 + i % 200);
+		CHECK(p != NULL);
+		if (i % 3 == 0)
+			p = mm_realloc(p, 1 + i % 500);
+		CHECK(p != NULL);
+		if (keep == NULL && i == NROUNDS / 2)
+			keep = p;
+		else
+			mm_free(p);
+	}
+	/* leave one live block behind, the thread's cache must outlive it */
+	return keep;
+}
+
+static void check_tags(void)
+{
+	mm_tag_stats_t st;
+
+	fresh_heap();
+
+	CHECK(mm_malloc_tagged(MM_MAX_TAGS, 8) == NULL);
+	CHECK(mm_tag_stats(MM_MAX_TAGS, &st) < 0);
+
+	void *a = mm_malloc_tagged(1, 100);
+	void *b = mm_malloc_tagged(1, 5000);
+	void *c = mm_malloc_tagged(2, 40);
+	CHECK(a != NULL && b != NULL && c != NULL);
+	CHECK(mm_tag_stats(1, &st) == 0);
+	CHECK(st.allocs == 2 && st.frees == 0 && st.live_bytes >= 5100);
+	long live_ab = st.live_bytes;
+
+	/* realloc keeps the tag, it counts as one allocation and one free */
+	b = mm_realloc(b, 20000);
+	CHECK(b != NULL);
+	CHECK(mm_tag_stats(1, &st) == 0);
+	CHECK(st.allocs == 3 && st.frees == 1 && st.live_bytes >= live_ab + 15000);
+
+	mm_free(a);
+	mm_free(b);
+	CHECK(mm_tag_stats(1, &st) == 0);
+	CHECK(st.allocs == 3 && st.frees == 3 && st.live_bytes == 0);
+	CHECK(mm_tag_stats(2, &st) == 0);
+	CHECK(st.allocs == 1 && st.frees == 0 && st.live_bytes >= 40);
+	mm_free(c);
+
+	pthread_t tid[NTHREADS];
+	void *kept[NTHREADS];
+	for (long t = 0; t < NTHREADS; t++)
+		CHECK(pthread_create(&tid[t], NULL, tag_thread, (void *)(10 + t)) == 0);
+	for (int t = 0; t < NTHREADS; t++)
+		CHECK(pthread_join(tid[t], &kept[t]) == 0);
+	for (int t = 0; t < NTHREADS; t++) {
+		CHECK(mm_tag_stats(10 + t, &st) == 0);
+		CHECK(st.allocs == NROUNDS + (NROUNDS + 2) / 3);
+		CHECK(st.frees == st.allocs - 1 && st.live_bytes > 0);
+		mm_free(kept[t]);
+		CHECK(mm_tag_stats(10 + t, &st) == 0);
+		CHECK(st.frees == st.allocs && st.live_bytes == 0);
+	}
+
+	/* a new heap starts the counters over */
+	fresh_heap();
+	CHECK(mm_tag_stats(10, &st) == 0);
+	CHECK(st.allocs == 0 && st.frees == 0 && st.live_bytes == 0);
+
+	printf("tags: ok\n");
+}
+
+/*
+ * retire
+ */
+static void *volatile shared[NSHARED];
+
+static void *retire_thread(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < NROUNDS; i++) {
+		int k = i % NSHARED;
+		mm_epoch_enter();
+		char *p = (char *)shared[k];
+		if (p != NULL)
+			CHECK(p[0] == 0x5a);
+		mm_epoch_exit();
+
+		char *n = (char *)mm_malloc_tagged(RETIRE_TAG, 32);
+		CHECK(n != NULL);
+		memset(n, 0x5a, 32);
+		mm_retire(__sync_lock_test_and_set(&shared[k], n));
+	}
+	mm_retire_flush();
+	return NULL;
+}
+
+/* retire without flushing and exit, a reader still holds the epoch */
+static void *orphan_thread(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < 4 * NSHARED; i++)
+		mm_retire(mm_malloc_tagged(ORPHAN_TAG, 32));
+	return NULL;
+}
+
+static void check_retire(void)
+{
+	mm_tag_stats_t st;
+
+	fresh_heap();
+	mm_retire(NULL);
+
+	pthread_t tid[NTHREADS];
+	for (int t = 0; t < NTHREADS; t++)
+		CHECK(pthread_create(&tid[t], NULL, retire_thread, NULL) == 0);
+	for (int t = 0; t < NTHREADS; t++)
+		CHECK(pthread_join(tid[t], NULL) == 0);
+
+	/* every replaced block went back to the heap, only the slots are live */
+	CHECK(mm_tag_stats(RETIRE_TAG, &st) == 0);
+	CHECK(st.allocs == NTHREADS * NROUNDS);
+	CHECK(st.allocs - st.frees == NSHARED);
+
+	for (int k = 0; k < NSHARED; k++) {
+		mm_free(shared[k]);
+		shared[k] = NULL;
+	}
+	CHECK(mm_tag_stats(RETIRE_TAG, &st) == 0);
+	CHECK(st.frees == st.allocs && st.live_bytes == 0);
+
+	/* the exiting thread does not wait for the reader, its blocks do */
+	pthread_t orphan;
+	mm_epoch_enter();
+	CHECK(pthread_create(&orphan, NULL, orphan_thread, NULL) == 0);
+	CHECK(pthread_join(orphan, NULL) == 0);
+	CHECK(mm_tag_stats(ORPHAN_TAG, &st) == 0);
+	CHECK(st.allocs == 4 * NSHARED && st.frees == 0);
+	mm_epoch_exit();
+	mm_retire_flush();
+	CHECK(mm_tag_stats(ORPHAN_TAG, &st) == 0);
+	CHECK(st.frees == st.allocs && st.live_bytes == 0);
+
+	printf("retire: ok\n");
+}
+
+/*
+ * smoke checks of one allocation path: blocks keep their contents through
+ * malloc, realloc and free, also when another thread frees them
+ */
+static void *(*smoke_malloc)(size_t);
+static void (*smoke_free)(void *);
+static char *smoke_blocks[NSMOKE];
+static size_t smoke_sizes[NSMOKE];
+
+static void smoke_fill(int i)
+{
+	memset(smoke_blocks[i], i & 0xff, smoke_sizes[i]);
+}
+
+static int smoke_intact(int i, size_t n)
+{
+	for (size_t j = 0; j < n; j++)
+		if ((unsigned char)smoke_blocks[i][j] != (i & 0xff))
+			return 0;
+	return 1;
+}
+
+static void *smoke_alloc(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < NSMOKE; i++) {
+		smoke_sizes[i] = 1 + (i * 37) % 600;
+		smoke_blocks[i] = (char *)smoke_malloc(smoke_sizes[i]);
+		CHECK(smoke_blocks[i] != NULL);
+		smoke_fill(i);
+	}
+	return NULL;
+}
+
+static void *smoke_release(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < NSMOKE; i++) {
+		CHECK(smoke_intact(i, smoke_sizes[i]));
+		smoke_free(smoke_blocks[i]);
+	}
+	return NULL;
+}
+
+static void smoke(const char *name, void *(*m)(size_t), void (*f)(void *))
+{
+	smoke_malloc = m;
+	smoke_free = f;
+
+	smoke_alloc(NULL);
+	for (int i = 0; i < NSMOKE; i += 3) {
+		size_t n = smoke_sizes[i];
+		smoke_sizes[i] = 1 + (i * 53) % 900;
+		smoke_blocks[i] = (char *)mm_realloc(smoke_blocks[i], smoke_sizes[i]);
+		CHECK(smoke_blocks[i] != NULL);
+		CHECK(smoke_intact(i, n < smoke_sizes[i]? n : smoke_sizes[i]));
+		smoke_fill(i);
+	}
+	smoke_release(NULL);
+
+	/* one thread allocates, another frees; they run one after the other,
+	   so builds without MM_THREADS pass too */
+	pthread_t tid;
+	CHECK(pthread_create(&tid, NULL, smoke_alloc, NULL) == 0);
+	CHECK(pthread_join(tid, NULL) == 0);
+	CHECK(pthread_create(&tid, NULL, smoke_release, NULL) == 0);
+	CHECK(pthread_join(tid, NULL) == 0);
+
+	printf("%s: ok\n", name);
+}
+
+/*
+ * worker
+ */
+static void check_worker(void)
+{
+	fresh_heap();
+	CHECK(mm_worker_start() == 0);
+	smoke("worker", mm_malloc, mm_free);
+	mm_worker_stop();
+}
+
+/*
+ * percpu
+ */
+static void check_percpu(void)
+{
+	fresh_heap();
+	if (mm_percpu_enable(1) < 0) {
+		printf("percpu: skipped, no per cpu caches\n");
+		return;
+	}
+	smoke("percpu", mm_malloc, mm_free);
+	CHECK(mm_percpu_enable(0) == 0);
+	smoke("percpu off", mm_malloc, mm_free);
+}
+
+/*
+ * hoard
+ */
+static void check_hoard(void)
+{
+	if (mm_hoard_enable(1) < 0) {
+		printf("hoard: skipped, no superblock heaps\n");
+		return;
+	}
+	fresh_heap();
+	smoke("hoard", mm_malloc, mm_free);
+}
+
+/*
+ * meta
+ */
+static void check_meta(void)
+{
+	void *lo, *hi;
+
+	if (mm_meta_range(&lo, &hi) < 0) {
+		printf("meta: skipped, no metadata pages\n");
+		return;
+	}
+	fresh_heap();
+	smoke("meta", mm_malloc, mm_free);
+	CHECK(mm_meta_range(&lo, &hi) == 0 && hi > lo);
+}
+
+/*
+ * stacks
+ */
+static void check_stacks(void)
+{
+	fresh_heap();
+	CHECK(mm_percpu_enable(0) == 0);
+	if (mm_lfstack_enable(1) < 0) {
+		printf("stacks: skipped, no class stacks\n");
+		return;
+	}
+	smoke("stacks", mm_malloc, mm_free);
+	CHECK(mm_lfstack_enable(0) == 0);
+	smoke("stacks off", mm_malloc, mm_free);
+	CHECK(mm_lfstack_enable(1) == 0);
+}
+
+/*
+ * inline
+ */
+static void check_inline(void)
+{
+	fresh_heap();
+	smoke("inline", mm_inline_malloc, mm_inline_free);
+
+	/* a cached block comes back on the next request of its class */
+	void *p = mm_inline_malloc(24);
+	CHECK(p != NULL);
+	mm_inline_free(p);
+	void *q = mm_inline_malloc(24);
+	CHECK(!mm_tcache.on || q == p);
+	mm_inline_free(q);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} sections[] = {
+	{ "ref32",  check_ref32 },
+	{ "tags",   check_tags },
+	{ "retire", check_retire },
+	{ "worker", check_worker },
+	{ "percpu", check_percpu },
+	{ "hoard",  check_hoard },
+	{ "meta",   check_meta },
+	{ "stacks", check_stacks },
+	{ "inline", check_inline },
+};
+
+#define NSECTIONS (int)(sizeof(sections) / sizeof(sections[0]))
+
+int main(int argc, char **argv)
+{
+	for (int a = 1; a < argc; a++) {
+		int s = 0;
+		while (s < NSECTIONS && strcmp(argv[a], sections[s].name) != 0)
+			s++;
+		if (s == NSECTIONS) {
+			fprintf(stderr, "usage: %s [section...]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	mem_init();
+	for (int s = 0; s < NSECTIONS; s++) {
+		int run = argc == 1;
+		for (int a = 1; a < argc; a++)
+			run |= strcmp(argv[a], sections[s].name) == 0;
+		if (run)
+			sections[s].run();
+	}
+	mem_deinit();
+	return 0;
+}
@@ -0,0 +1,330 @@
+/*
+ * mtbench.c - Many-threads benchmark for the small block caches in mm.c
+ *
+ * Starts a large number of threads that each allocate and free small
+ * blocks, and reports throughput and heap size for six setups:
+ *   heap    - every request goes to the locked heap
+ *   thread  - a per-thread cache of the same depth sits in front of it
+ *   cpu     - the rseq per-cpu caches in mm.c (-DMM_PERCPU)
+ *   lfstack - the lock-free class stacks in mm.c (-DMM_LFSTACKS)
+ *   inline  - the per-thread caches of mm_inline.h, inlined here
+ *   hoard   - the superblock heaps in mm.c (-DMM_HOARD, mtbench-hoard)
+ * Per-thread caches keep blocks parked in every live thread, so the heap
+ * grows with the thread count; per-cpu caches only with the core count.
+ * With -p the threads pair up: one allocates, its partner frees what it
+ * gets through a ring, and the peak live bytes are reported next to the
+ * heap, the blowup the superblock heaps bound.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "mm_inline.h"
+#include "memlib.h"
+
+/* Defaults, overridable on the command line */
+#define NTHREADS   1000  /* threads alive at the same time */
+#define NROUNDS    200   /* allocate/free rounds per thread */
+#define NLIVE      16    /* blocks a thread holds per round */
+
+/* Blocks in flight between a producer and its consumer (-p) */
+#define RING       64
+
+/* Per-thread cache model: same shape as the per-cpu caches in mm.c */
+#define TCLASSES   16
+#define TDEPTH     32
+#define MAXSIZE    (TCLASSES * 8 - 4)
+
+typedef struct {
+	int count[TCLASSES + 1];
+	void *slots[TCLASSES + 1][TDEPTH];
+} tcache_t;
+
+static enum { MODE_HEAP, MODE_THREAD, MODE_CPU, MODE_LFSTACK, MODE_INLINE, MODE_HOARD } mode;
+static const char *mode_names[] = { "heap", "thread", "cpu", "lfstack", "inline", "hoard" };
+
+static int nthreads = NTHREADS;
+static int nrounds = NROUNDS;
+static pthread_barrier_t done_barrier;
+
+static __thread tcache_t *tcache;
+
+typedef struct {
+	void *volatile blks[RING];
+	size_t sizes[RING];
+	volatile unsigned long head, tail;
+} ring_t;
+
+static int pairs;                 /* -p: producer/consumer pairs */
+static ring_t *rings;
+static volatile long live_bytes;  /* requested bytes not yet freed, -p only */
+static volatile long peak_live;
+
+/* class of a request, the same rounding as mm.c */
+static int tclass(size_t size)
+{
+	size_t asize = (size + 4 + 7) / 8 * 8;
+	return asize < 16 ? 2 : (int)(asize / 8);
+}
+
+static void *bench_malloc(size_t size)
+{
+	if (mode == MODE_INLINE)
+		return mm_inline_malloc(size);
+	if (mode == MODE_THREAD) {
+		int c = tclass(size);
+		if (tcache->count[c] > 0)
+			return tcache->slots[c][--tcache->count[c]];
+	}
+	return mm_malloc(size);
+}
+
+static void bench_free(void *ptr, size_t size)
+{
+	if (mode == MODE_INLINE) {
+		mm_inline_free(ptr);
+		return;
+	}
+	if (mode == MODE_THREAD) {
+		int c = tclass(size);
+		if (tcache->count[c] < TDEPTH) {
+			tcache->slots[c][tcache->count[c]++] = ptr;
+			return;
+		}
+	}
+	mm_free(ptr);
+}
+
+/*
+ * worker - Run the rounds, then stay alive until every thread is done,
+ *     so the per-thread caches are all populated when the heap is measured.
+ */
+static void *worker(void *arg)
+{
+	unsigned int seed = (unsigned int)(long)arg;
+	void *blocks[NLIVE];
+	size_t sizes[NLIVE];
+	tcache_t cache;
+	int r, i;
+
+	memset(&cache, 0, sizeof(cache));
+	tcache = &cache;
+	for (r = 0; r < nrounds; r++) {
+		for (i = 0; i < NLIVE; i++) {
+			sizes[i] = 1 + rand_r(&seed) % MAXSIZE;
+			if ((blocks[i] = bench_malloc(sizes[i])) == NULL) {
+				fprintf(stderr, "mm_malloc failed\n");
+				exit(1);
+			}
+			memset(blocks[i], 0, sizes[i]);
+		}
+		for (i = 0; i < NLIVE; i++)
+			bench_free(blocks[i], sizes[i]);
+	}
+	pthread_barrier_wait(&done_barrier);
+	return NULL;
+}
+
+/* add delta to the live bytes and keep the peak */
+static void count_live(long delta)
+{
+	long live = __sync_add_and_fetch(&live_bytes, delta);
+	long peak;
+
+	while (live > (peak = peak_live))
+		if (__sync_bool_compare_and_swap(&peak_live, peak, live))
+			break;
+}
+
+/*
+ * producer - Allocate the rounds and hand every block to the consumer
+ */
+static void *producer(void *arg)
+{
+	unsigned int seed = (unsigned int)(long)arg;
+	ring_t *ring = &rings[((long)arg - 1) / 2];
+	tcache_t cache;
+	size_t size;
+	void *ptr;
+	int n;
+
+	memset(&cache, 0, sizeof(cache));
+	tcache = &cache;
+	for (n = 0; n < nrounds * NLIVE; n++) {
+		size = 1 + rand_r(&seed) % MAXSIZE;
+		if ((ptr = bench_malloc(size)) == NULL) {
+			fprintf(stderr, "mm_malloc failed\n");
+			exit(1);
+		}
+		memset(ptr, 0, size);
+		count_live(size);
+		while (ring->tail - ring->head == RING)
+			sched_yield();
+		ring->blks[ring->tail % RING] = ptr;
+		ring->sizes[ring->tail % RING] = size;
+		__sync_synchronize();
+		ring->tail++;
+	}
+	pthread_barrier_wait(&done_barrier);
+	return NULL;
+}
+
+/*
+ * consumer - Free every block the producer hands over
+ */
+static void *consumer(void *arg)
+{
+	ring_t *ring = &rings[((long)arg - 1) / 2];
+	tcache_t cache;
+	size_t size;
+	void *ptr;
+	int n;
+
+	memset(&cache, 0, sizeof(cache));
+	tcache = &cache;
+	for (n = 0; n < nrounds * NLIVE; n++) {
+		while (ring->head == ring->tail)
+			sched_yield();
+		__sync_synchronize();
+		ptr = ring->blks[ring->head % RING];
+		size = ring->sizes[ring->head % RING];
+		ring->head++;
+		count_live(-(long)size);
+		bench_free(ptr, size);
+	}
+	pthread_barrier_wait(&done_barrier);
+	return NULL;
+}
+
+/*
+ * run - Time one setup on a fresh heap
+ */
+static void run(void)
+{
+	pthread_t *tids;
+	pthread_attr_t attr;
+	struct timespec t0, t1;
+	double secs, ops;
+	int i;
+
+	if ((tids = malloc(nthreads * sizeof(pthread_t))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	mem_reset_brk();
+	if (mm_init() < 0) {
+		fprintf(stderr, "mm_init failed\n");
+		exit(1);
+	}
+	if (mm_percpu_enable(mode == MODE_CPU) < 0) {
+		printf("%-8s (per-cpu caches unavailable in this build)\n",
+				mode_names[mode]);
+		free(tids);
+		return;
+	}
+	if (mm_lfstack_enable(mode == MODE_LFSTACK) < 0) {
+		printf("%-8s (class stacks unavailable in this build)\n",
+				mode_names[mode]);
+		free(tids);
+		return;
+	}
+	if (mm_hoard_enable(mode == MODE_HOARD) < 0) {
+		printf("%-8s (superblock heaps unavailable in this build)\n",
+				mode_names[mode]);
+		free(tids);
+		return;
+	}
+
+	if (pairs) {
+		memset(rings, 0, nthreads / 2 * sizeof(ring_t));
+		live_bytes = peak_live = 0;
+	}
+	pthread_barrier_init(&done_barrier, NULL, nthreads + 1);
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 1 << 16);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nthreads; i++) {
+		void *(*fn)(void *) = !pairs? worker : i % 2 == 0? producer : consumer;
+		if (pthread_create(&tids[i], &attr, fn, (void *)(long)(i + 1)) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	pthread_barrier_wait(&done_barrier);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(tids[i], NULL);
+	pthread_barrier_destroy(&done_barrier);
+	pthread_attr_destroy(&attr);
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	ops = (pairs? 1.0 : 2.0) * nthreads * nrounds * NLIVE;
+	printf("%-8s%10.0f%10.3f%12.0f%12lu", mode_names[mode],
+			ops, secs, ops / 1e3 / secs, (unsigned long)mem_heapsize());
+	if (pairs)
+		printf("%12ld%8.1f", peak_live, (double)mem_heapsize() / peak_live);
+	printf("\n");
+	mm_percpu_enable(0);
+	mm_lfstack_enable(0);
+	mm_hoard_enable(0);
+	free(tids);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: mtbench [-hp] [-t <threads>] [-r <rounds>]\n");
+	fprintf(stderr, "\t-t <n>  Number of threads (default %d).\n", NTHREADS);
+	fprintf(stderr, "\t-r <n>  Rounds per thread (default %d).\n", NROUNDS);
+	fprintf(stderr, "\t-p      Pair the threads, one allocates and the other frees.\n");
+	fprintf(stderr, "\t-h      Print this message.\n");
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "t:r:ph")) != EOF) {
+		switch (c) {
+			case 't':
+				nthreads = atoi(optarg);
+				break;
+			case 'r':
+				nrounds = atoi(optarg);
+				break;
+			case 'p':
+				pairs = 1;
+				break;
+			case 'h':
+				usage();
+				exit(0);
+			default:
+				usage();
+				exit(1);
+		}
+	}
+
+	if (pairs) {
+		nthreads = nthreads < 2? 2 : nthreads / 2 * 2;
+		if ((rings = malloc(nthreads / 2 * sizeof(ring_t))) == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+	}
+
+	mem_init();
+	printf("%d threads%s, %d rounds of %d blocks of 1..%d bytes, %ld cpus\n",
+			nthreads, pairs? " in producer/consumer pairs" : "", nrounds,
+			NLIVE, MAXSIZE, sysconf(_SC_NPROCESSORS_ONLN));
+	printf("%-8s%10s%10s%12s%12s", "cache", "ops", "secs", "Kops", "heap");
+	if (pairs)
+		printf("%12s%8s", "peak live", "blowup");
+	printf("\n");
+	for (mode = MODE_HEAP; mode <= MODE_HOARD; mode++)
+		run();
+	return 0;
+}